@@ -0,0 +1,620 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+#define BENCH_ARGUMENT_COUNT 3 /* Workload, address, port */
+#define MAX_CONNECTIONS 256
+#define MAX_DEPTH 64 /* Requests in flight per connection */
+#define MAX_HELLO_PAYLOAD 64
+#define MAX_PATH_LENGTH 4096
+#define OPERATIONS 10000
+#define READ_SIZE (128 * 1024)
+#define DATASET_ENTRIES 1000
+#define DATASET_FILE_SIZE (64 * 1024 * 1024)
+#define FILE_PATH "/bench/file"
+#define DIR_PATH "/bench/dir"
+
+enum workload {
+    GETATTR_STORM,
+    READDIR_LIST,
+    READDIRPLUS_LIST,
+    SEQUENTIAL_READ,
+    RANDOM_READ,
+};
+
+static const char *workload_names[] = {"getattr", "readdir", "readdirplus",
+                                       "seqread", "randread"};
+
+/* Set by main, read-only once the connections start. */
+struct bench_config {
+    enum workload workload;
+    struct sockaddr_storage addr;
+    socklen_t addr_size;
+    int transport;
+    int connections;
+    int depth;
+    uint64_t operations; /* 0 when running for a duration */
+    uint64_t duration_us;
+    size_t read_size;
+    const char *path;
+};
+
+/* A request in flight, its tag is the index in slots. */
+struct bench_slot {
+    uint64_t start_us; /* Of the operation, a listing spans several pages */
+    uint64_t cookie;   /* Of the last entry listed */
+};
+
+/* One connection, driven by its own thread. */
+struct bench_connection {
+    pthread_t thread;
+    int sock_fd;
+    struct netfs_shm *shm;
+    uint64_t operations; /* To run, 0 when running for a duration */
+    uint64_t start_us;   /* Once set up, until end_us */
+    uint64_t end_us;
+    uint64_t handle;     /* Of path, for the read workloads */
+    uint64_t file_size;
+    uint64_t next_offset;
+    unsigned int seed;
+    struct bench_slot slots[MAX_DEPTH];
+    uint8_t *payload;
+
+    uint32_t *latencies; /* Microseconds, one per operation */
+    size_t count;
+    size_t capacity;
+    uint64_t bytes;
+    uint64_t entries;
+    uint64_t errors;
+    bool failed;
+};
+
+static struct bench_config cfg;
+
+static void usage(char *name)
+{
+    fprintf(stdout,
+            "%s: Usage: %s [-c connections] [-q requests in flight per "
+            "connection] [-n operations] [-t seconds] [-s read size] "
+            "[-p path] [getattr, readdir, readdirplus, seqread or randread] "
+            "[storage address: IP, unix:PATH or shm:PATH] [storage port]\n"
+            "       %s -g [storage directory] [-e directory entries] "
+            "[-f file size]\n",
+            name, name, name);
+}
+
+/* Like sendallv on the connection's socket or ring. */
+static int bench_sendallv(struct bench_connection *con, struct iovec *iov,
+                          int iovcnt)
+{
+    if (con->shm != NULL)
+        return netfs_shm_sendallv(con->shm, iov, iovcnt);
+    return sendallv(con->sock_fd, iov, iovcnt);
+}
+
+static int bench_recvall(struct bench_connection *con, void *buf, size_t size)
+{
+    struct iovec iov = {buf, size};
+    if (con->shm != NULL)
+        return netfs_shm_recvallv(con->shm, &iov, 1);
+    return recvallv(con->sock_fd, &iov, 1);
+}
+
+static int send_packet(struct bench_connection *con, netfs_oper op,
+                       uint32_t tag, const void *payload, size_t length,
+                       const void *extra, size_t extra_length)
+{
+    struct netfs_header header;
+    PREP_NETFS_HEADER(&header, length + extra_length, op, tag);
+    struct iovec iov[] = {{&header, NETFS_HEADER_SIZE},
+                          {(void *)payload, length},
+                          {(void *)extra, extra_length}};
+    return bench_sendallv(con, iov, 3);
+}
+
+/* Receives a whole response into con->payload, header in host order. */
+static int receive_response(struct bench_connection *con,
+                            struct netfs_header *header)
+{
+    if (bench_recvall(con, header, NETFS_HEADER_SIZE) < 0) {
+        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
+        return -1;
+    }
+    header->payload_length = ntohl(header->payload_length);
+    header->tag = ntohl(header->tag);
+    if (header->payload_length > NETFS_MAX_BUFFER) {
+        fprintf(stderr, "Response too large: %u\n", header->payload_length);
+        return -1;
+    }
+    if (bench_recvall(con, con->payload, header->payload_length) < 0) {
+        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Connects and exchanges HELLO, returns -1 if the server can not be used. */
+static int bench_connect(struct bench_connection *con)
+{
+    if ((con->sock_fd = socket(cfg.addr.ss_family, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "Socket creation failed! Error: %s\n", strerror(errno));
+        return -1;
+    }
+    if (connect(con->sock_fd, (struct sockaddr *)&cfg.addr, cfg.addr_size) <
+        0) {
+        fprintf(stderr, "Could not connect %s\n", strerror(errno));
+        return -1;
+    }
+    if (cfg.transport == NETFS_TRANSPORT_SHM &&
+        (con->shm = netfs_shm_attach(con->sock_fd)) == NULL) {
+        fprintf(stderr, "Shared memory setup failed %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct netfs_hello hello;
+    hello.version = htonl(NETFS_VERSION);
+    hello.capabilities = htonl(NETFS_CAP_READDIRPLUS);
+    hello.max_request = 0;
+    hello.max_response = htonl(NETFS_MAX_BUFFER);
+    hello.io_size = htonl(cfg.read_size);
+    struct netfs_header header;
+    if (send_packet(con, HELLO, 0, &hello, sizeof(hello), NULL, 0) < 0 ||
+        receive_response(con, &header) < 0)
+        return -1;
+    if (header.operation != HELLO_R ||
+        header.payload_length < sizeof(struct netfs_hello) ||
+        header.payload_length > MAX_HELLO_PAYLOAD) {
+        fprintf(stderr, "Handshake failed\n");
+        return -1;
+    }
+    memcpy(&hello, con->payload, sizeof(hello));
+    uint32_t caps = ntohl(hello.capabilities);
+    if (cfg.workload == READDIRPLUS_LIST && !(caps & NETFS_CAP_READDIRPLUS)) {
+        fprintf(stderr, "The server does not support READDIRPLUS\n");
+        return -1;
+    }
+    if ((cfg.workload == SEQUENTIAL_READ || cfg.workload == RANDOM_READ) &&
+        cfg.read_size > ntohl(hello.max_response)) {
+        fprintf(stderr, "Read size above the server's limit of %u\n",
+                ntohl(hello.max_response));
+        return -1;
+    }
+    return 0;
+}
+
+/* Sends a request and waits for its response, before the workload runs. */
+static int bench_transact(struct bench_connection *con, netfs_oper op,
+                          const void *payload, size_t length,
+                          struct netfs_header *header)
+{
+    if (send_packet(con, op, 0, payload, length, NULL, 0) < 0 ||
+        receive_response(con, header) < 0)
+        return -1;
+    if (header->operation == ERROR) {
+        fprintf(stderr, "%s: %s\n", cfg.path,
+                strerror(ntohl(*(uint32_t *)con->payload)));
+        return -1;
+    }
+    return 0;
+}
+
+/* Opens path for the read workloads and learns its size. */
+static int open_file(struct bench_connection *con)
+{
+    struct netfs_header header;
+    if (bench_transact(con, GETATTR, cfg.path, strlen(cfg.path), &header) < 0)
+        return -1;
+    struct netfs_attrs *attrs = (struct netfs_attrs *)con->payload;
+    con->file_size = ntohl(attrs->size);
+    if (con->file_size < cfg.read_size) {
+        fprintf(stderr, "%s is smaller than a read\n", cfg.path);
+        return -1;
+    }
+    if (bench_transact(con, OPEN, cfg.path, strlen(cfg.path), &header) < 0)
+        return -1;
+    con->handle = be64toh(*(uint64_t *)con->payload);
+    return 0;
+}
+
+static int send_readdir(struct bench_connection *con, uint32_t tag)
+{
+    struct netfs_readdir readdir_inf;
+    readdir_inf.cookie = htobe64(con->slots[tag].cookie);
+    netfs_oper op = cfg.workload == READDIRPLUS_LIST ? READDIRPLUS : READDIR;
+    return send_packet(con, op, tag, &readdir_inf, sizeof(readdir_inf),
+                       cfg.path, strlen(cfg.path));
+}
+
+/* Starts the next operation of the workload in slot tag. */
+static int start_operation(struct bench_connection *con, uint32_t tag)
+{
+    struct bench_slot *slot = &con->slots[tag];
+    slot->start_us = netfs_monotonic_us();
+    slot->cookie = 0;
+
+    struct netfs_read_write read_inf;
+    uint64_t blocks = con->file_size / cfg.read_size;
+    switch (cfg.workload) {
+    case GETATTR_STORM:
+        return send_packet(con, GETATTR, tag, cfg.path, strlen(cfg.path), NULL,
+                           0);
+    case READDIR_LIST:
+    case READDIRPLUS_LIST:
+        return send_readdir(con, tag);
+    case SEQUENTIAL_READ:
+        if (con->next_offset + cfg.read_size > con->file_size)
+            con->next_offset = 0;
+        read_inf.file_offset = htobe64(con->next_offset);
+        con->next_offset += cfg.read_size;
+        break;
+    case RANDOM_READ:
+        read_inf.file_offset =
+            htobe64(rand_r(&con->seed) % blocks * cfg.read_size);
+        break;
+    }
+    read_inf.handle = htobe64(con->handle);
+    read_inf.count = htobe64(cfg.read_size);
+    return send_packet(con, READ, tag, &read_inf, sizeof(read_inf), NULL, 0);
+}
+
+/*
+ * Counts the entries of a READDIR_R page and remembers the last cookie.
+ * Returns true if the listing is complete.
+ */
+static bool parse_page(struct bench_connection *con, uint32_t tag,
+                       uint32_t length)
+{
+    size_t attrs_size =
+        cfg.workload == READDIRPLUS_LIST ? sizeof(struct netfs_attrs) : 0;
+    uint8_t *entries = con->payload;
+    if (length == 0)
+        return true;
+    uint32_t i = 1;
+    while (i + attrs_size + sizeof(uint64_t) + 1 <= length) {
+        uint8_t *entry = &entries[i] + attrs_size;
+        con->slots[tag].cookie = be64toh(*(uint64_t *)entry);
+        con->entries++;
+        i += attrs_size + sizeof(uint64_t) + 1 + entry[sizeof(uint64_t)];
+    }
+    return entries[0];
+}
+
+static void record_latency(struct bench_connection *con, uint64_t us)
+{
+    if (con->count == con->capacity) {
+        con->capacity = con->capacity == 0 ? 1024 : 2 * con->capacity;
+        con->latencies =
+            realloc(con->latencies, con->capacity * sizeof(uint32_t));
+    }
+    con->latencies[con->count++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+static bool more_operations(struct bench_connection *con, uint64_t issued)
+{
+    if (cfg.operations != 0)
+        return issued < con->operations;
+    return netfs_monotonic_us() < con->start_us + cfg.duration_us;
+}
+
+/* Runs the connection's share of the workload, -1 if it failed. */
+static int run_connection(struct bench_connection *con)
+{
+    if (bench_connect(con) < 0 ||
+        ((cfg.workload == SEQUENTIAL_READ || cfg.workload == RANDOM_READ) &&
+         open_file(con) < 0))
+        return -1;
+
+    con->start_us = netfs_monotonic_us();
+    uint64_t issued = 0;
+    uint64_t completed = 0;
+    uint32_t tag;
+    for (tag = 0; tag < (uint32_t)cfg.depth && more_operations(con, issued);
+         tag++) {
+        if (start_operation(con, tag) < 0)
+            return -1;
+        issued++;
+    }
+    while (completed < issued) {
+        struct netfs_header header;
+        if (receive_response(con, &header) < 0 ||
+            header.tag >= (uint32_t)cfg.depth)
+            return -1;
+        tag = header.tag;
+        if (header.operation == ERROR) {
+            con->errors++;
+        } else {
+            con->bytes += header.payload_length;
+            if ((cfg.workload == READDIR_LIST ||
+                 cfg.workload == READDIRPLUS_LIST) &&
+                !parse_page(con, tag, header.payload_length)) {
+                if (send_readdir(con, tag) < 0)
+                    return -1;
+                continue;
+            }
+        }
+        record_latency(con, netfs_monotonic_us() - con->slots[tag].start_us);
+        completed++;
+        if (more_operations(con, issued)) {
+            if (start_operation(con, tag) < 0)
+                return -1;
+            issued++;
+        }
+    }
+    con->end_us = netfs_monotonic_us();
+    return 0;
+}
+
+static void *bench_thread(void *arg)
+{
+    struct bench_connection *con = (struct bench_connection *)arg;
+    con->payload = malloc(NETFS_MAX_BUFFER);
+    con->failed = run_connection(con) < 0;
+    if (con->shm != NULL)
+        netfs_shm_free(con->shm);
+    if (con->sock_fd >= 0)
+        close(con->sock_fd);
+    free(con->payload);
+    return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* latencies is sorted. permille of the samples are at or below the result. */
+static uint32_t percentile(const uint32_t *latencies, size_t count,
+                           unsigned int permille)
+{
+    size_t rank = (count * permille + 999) / 1000;
+    return latencies[rank > 0 ? rank - 1 : 0];
+}
+
+/* Throughput is over the time from the first start to the last end. */
+static void report(struct bench_connection *connections)
+{
+    size_t count = 0;
+    uint64_t bytes = 0;
+    uint64_t entries = 0;
+    uint64_t errors = 0;
+    uint64_t start_us = UINT64_MAX;
+    uint64_t end_us = 0;
+    int i;
+    for (i = 0; i < cfg.connections; i++) {
+        /* A connection that failed to set up never started. */
+        if (connections[i].start_us != 0 && connections[i].start_us < start_us)
+            start_us = connections[i].start_us;
+        if (connections[i].end_us > end_us)
+            end_us = connections[i].end_us;
+        count += connections[i].count;
+        bytes += connections[i].bytes;
+        entries += connections[i].entries;
+        errors += connections[i].errors;
+    }
+    if (count == 0) {
+        fprintf(stdout, "%s: no operations completed\n",
+                workload_names[cfg.workload]);
+        return;
+    }
+    uint32_t *latencies = malloc(count * sizeof(uint32_t));
+    size_t merged = 0;
+    for (i = 0; i < cfg.connections; i++) {
+        memcpy(latencies + merged, connections[i].latencies,
+               connections[i].count * sizeof(uint32_t));
+        merged += connections[i].count;
+    }
+    qsort(latencies, count, sizeof(uint32_t), compare_latencies);
+
+    double seconds = (end_us - start_us) / 1e6;
+    fprintf(stdout,
+            "%s %s: %d connections x %d in flight, %zu operations in "
+            "%.3f s, %" PRIu64 " errors\n",
+            workload_names[cfg.workload], cfg.path, cfg.connections,
+            cfg.depth, count, seconds, errors);
+    fprintf(stdout, "  %.1f ops/s, %.1f MB/s", count / seconds,
+            bytes / seconds / (1024 * 1024));
+    if (cfg.workload == READDIR_LIST || cfg.workload == READDIRPLUS_LIST)
+        fprintf(stdout, ", %.1f entries per listing",
+                (double)entries / count);
+    fprintf(stdout,
+            "\n  latency us: p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+            percentile(latencies, count, 500),
+            percentile(latencies, count, 900),
+            percentile(latencies, count, 990),
+            percentile(latencies, count, 999), latencies[count - 1]);
+    free(latencies);
+}
+
+/* Writes size bytes of a repeating pattern to path. */
+static int generate_file(const char *path, uint64_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    char *chunk = malloc(READ_SIZE);
+    size_t i;
+    for (i = 0; i < READ_SIZE; i++)
+        chunk[i] = 'a' + i % 26;
+    uint64_t written = 0;
+    while (written < size) {
+        size_t length =
+            size - written < READ_SIZE ? size - written : READ_SIZE;
+        if (write(fd, chunk, length) != (ssize_t)length) {
+            free(chunk);
+            close(fd);
+            return -1;
+        }
+        written += length;
+    }
+    free(chunk);
+    return close(fd);
+}
+
+/* Creates FILE_PATH and DIR_PATH, with entries files, below dir. */
+static int generate_dataset(const char *dir, int entries, uint64_t file_size)
+{
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/bench", dir);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        return -1;
+    snprintf(path, sizeof(path), "%s%s", dir, DIR_PATH);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        return -1;
+    int i;
+    for (i = 0; i < entries; i++) {
+        snprintf(path, sizeof(path), "%s%s/%d", dir, DIR_PATH, i);
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0)
+            return -1;
+        close(fd);
+    }
+    snprintf(path, sizeof(path), "%s%s", dir, FILE_PATH);
+    return generate_file(path, file_size);
+}
+
+static int parse_workload(const char *name)
+{
+    size_t i;
+    for (i = 0; i < sizeof(workload_names) / sizeof(workload_names[0]); i++) {
+        if (strcmp(name, workload_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void set_address(const char *address, uint16_t port)
+{
+    const char *path;
+    cfg.transport = netfs_parse_address(address, &path);
+    if (cfg.transport == NETFS_TRANSPORT_TCP) {
+        struct sockaddr_in *addr = (struct sockaddr_in *)&cfg.addr;
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(port);
+        inet_pton(AF_INET, address, &addr->sin_addr.s_addr);
+        cfg.addr_size = sizeof(struct sockaddr_in);
+    } else {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&cfg.addr;
+        addr->sun_family = AF_UNIX;
+        strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+        cfg.addr_size = sizeof(struct sockaddr_un);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    cfg.connections = 1;
+    cfg.depth = 1;
+    cfg.operations = OPERATIONS;
+    cfg.read_size = READ_SIZE;
+    char *dataset_dir = NULL;
+    int entries = DATASET_ENTRIES;
+    uint64_t file_size = DATASET_FILE_SIZE;
+    int seconds = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:q:n:t:s:p:g:e:f:")) != -1) {
+        switch (opt) {
+        case 'c':
+            cfg.connections = atoi(optarg);
+            break;
+        case 'q':
+            cfg.depth = atoi(optarg);
+            break;
+        case 'n':
+            cfg.operations = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            cfg.read_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            cfg.path = optarg;
+            break;
+        case 'g':
+            dataset_dir = optarg;
+            break;
+        case 'e':
+            entries = atoi(optarg);
+            break;
+        case 'f':
+            file_size = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (dataset_dir != NULL) {
+        if (argc != optind || entries < 0) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (generate_dataset(dataset_dir, entries, file_size) < 0) {
+            fprintf(stderr, "Generating the dataset failed, Error: %s\n",
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        return 0;
+    }
+
+    int workload = argc - optind == BENCH_ARGUMENT_COUNT
+                       ? parse_workload(argv[optind])
+                       : -1;
+    if (workload < 0 || cfg.connections < 1 ||
+        cfg.connections > MAX_CONNECTIONS || cfg.depth < 1 ||
+        cfg.depth > MAX_DEPTH || seconds < 0 ||
+        (cfg.operations == 0 && seconds == 0) || cfg.read_size == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    cfg.workload = workload;
+    if (cfg.path == NULL)
+        cfg.path = cfg.workload == READDIR_LIST ||
+                           cfg.workload == READDIRPLUS_LIST
+                       ? DIR_PATH
+                       : FILE_PATH;
+    set_address(argv[optind + 1], atoi(argv[optind + 2]));
+
+    if (seconds > 0) {
+        cfg.operations = 0;
+        cfg.duration_us = (uint64_t)seconds * 1000000;
+    }
+    struct bench_connection *connections =
+        calloc(cfg.connections, sizeof(struct bench_connection));
+    int i;
+    for (i = 0; i < cfg.connections; i++) {
+        struct bench_connection *con = &connections[i];
+        con->operations = cfg.operations / cfg.connections +
+                          (i < (int)(cfg.operations % cfg.connections));
+        con->seed = i + 1;
+        con->sock_fd = -1;
+        pthread_create(&con->thread, NULL, bench_thread, (void *)con);
+    }
+    bool failed = false;
+    for (i = 0; i < cfg.connections; i++) {
+        pthread_join(connections[i].thread, NULL);
+        failed |= connections[i].failed;
+    }
+    report(connections);
+    return failed ? EXIT_FAILURE : 0;
+}
@@ -4,62 +4,445 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "protocol.h"
 #include "utlist.h"
 
 #define CLIENT_ARGUMENT_COUNT 4
-#define MAX_CONNECTIONS 4
+#define MAX_CONNECTIONS 4 /* Per server */
+#define MAX_SERVERS 16
+#define HASH_RING_POINTS 128 /* Per server, evens out the path shares */
+#define MAX_INFLIGHT 64 /* Outstanding requests per connection */
+#define MAX_ERROR_PAYLOAD 64
+#define MAX_HELLO_PAYLOAD 64
+#define READ_PACKET_SIZE NETFS_PACKET_SIZE(sizeof(struct netfs_read_write))
+/* Read-only and not listed, the client's statistics as text */
+#define STATS_PATH "/.netfs_stats"
 
+/* Attribute cache defaults, overridable with -o attr_ttl=,attr_cache_size= */
+#define ATTR_CACHE_TTL 5.0
+#define ATTR_CACHE_SIZE 8192
+
+struct attr_cache_entry {
+    char *path;
+    uint32_t hash;
+    struct stat st;
+    uint64_t expires; /* Monotonic milliseconds */
+
+    /* Hash bucket chain */
+    struct attr_cache_entry *hnext;
+    struct attr_cache_entry *hprev;
+    /* LRU list, head is the least recently used entry */
+    struct attr_cache_entry *next;
+    struct attr_cache_entry *prev;
+};
+
+struct attr_cache {
+    struct attr_cache_entry **buckets;
+    uint32_t bucket_mask;
+    struct attr_cache_entry *lru;
+    unsigned int count;
+    unsigned int capacity;
+    uint64_t ttl; /* Milliseconds, 0 disables the cache */
+    pthread_mutex_t lock;
+    uint64_t generation; /* Bumped by invalidations */
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+/* Data cache defaults, overridable with -o block_cache_size=MEGABYTES */
+#define BLOCK_SIZE (128 * 1024)
+#define BLOCK_CACHE_SIZE 64
+
+/* Cached blocks of one file, valid while the server reports this version. */
+struct block_cache_file {
+    char *path;
+    uint32_t hash;
+    time_t mtime;
+    off_t size;
+    struct block_cache_block *blocks;
+
+    struct block_cache_file *hnext;
+    struct block_cache_file *hprev;
+};
+
+struct block_cache_block {
+    struct block_cache_file *file;
+    uint64_t index;
+    uint32_t hash;
+    bool pending; /* Reserved, the data is still being fetched */
+    uint64_t generation; /* Of the cache when the block was reserved */
+    size_t length; /* Shorter than BLOCK_SIZE only at end of file */
+    char *data;
+
+    /* Hash bucket chain */
+    struct block_cache_block *hnext;
+    struct block_cache_block *hprev;
+    /* Blocks of the same file */
+    struct block_cache_block *fnext;
+    struct block_cache_block *fprev;
+    /* LRU list, head is the least recently used block */
+    struct block_cache_block *next;
+    struct block_cache_block *prev;
+};
+
+struct block_cache {
+    struct block_cache_file **file_buckets;
+    struct block_cache_block **block_buckets;
+    uint32_t bucket_mask;
+    struct block_cache_block *lru;
+    unsigned int count;
+    unsigned int capacity; /* In blocks, 0 disables the cache */
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    uint64_t generation; /* Bumped by invalidations */
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+/* Readahead defaults, the window is overridable with -o readahead=BLOCKS */
+#define READAHEAD_MIN 2
+#define READAHEAD_MAX 16
+
+/* With several servers, files are read from each in turn in stripes. */
+#define STRIPE_SIZE (8 * BLOCK_SIZE)
+
+/*
+ * Response times are kept per operation, in two buckets per power of two
+ * microseconds. Counts are halved now and then to follow the servers.
+ */
+#define LATENCY_BUCKETS 64
+#define LATENCY_WINDOW 4096 /* Samples between halvings */
+
+struct latency_histogram {
+    uint32_t counts[LATENCY_BUCKETS];
+    uint32_t total;
+};
+
+/*
+ * A read or getattr still unanswered after the hedge percentile of its
+ * operation's response times is sent to another server as well.
+ */
+#define HEDGE_PERCENTILE 95
+#define HEDGE_MIN_SAMPLES 64 /* Nothing is hedged before that */
+#define HEDGE_MIN_DELAY 500  /* Microseconds */
+#define HEDGE_BUDGET 10      /* Percent of the requests hedged at most */
+#define HEDGE_WINDOW 65536   /* Requests between halvings of the counts */
+
+/* Stored in fuse_file_info->fh of an open STATS_PATH. */
+struct stats_snapshot {
+    size_t length;
+    char text[NETFS_STATS_TEXT_MAX];
+};
+
+/* Per open directory, the part of the last page FUSE had no room for. */
+struct netfs_dir {
+    uint8_t *page;       /* READDIR_R payload, NULL if none is kept */
+    uint32_t length;
+    uint32_t position;   /* Of the first entry not handed to filler */
+    uint64_t cookie;     /* The offset FUSE resumes from to reach it */
+    uint64_t generation; /* Of the attribute cache before the page came */
+    bool plus;
+};
+
+/* Per open file state, stored in fuse_file_info->fh. */
+struct netfs_file {
+    pthread_mutex_t lock;
+    /* Per server handles, 0 until opened there, replaced if they go stale */
+    uint64_t handles[MAX_SERVERS];
+    off_t next_offset;   /* Where a sequential read would continue */
+    unsigned int window; /* Blocks to keep fetched ahead, 0 for random */
+    uint64_t ra_next;    /* First block not yet handed to readahead */
+};
+
+/* A request waiting for its response. */
+struct netfs_request {
+    int server;                 /* Index in cfg.servers, set by the caller */
+    struct netfs_header header; /* Response header, host byte order */
+    void *payload;              /* Response payload, owned by the caller */
+    int error;                  /* errno of an ERROR response, no payload */
+    int status;                 /* -1 if the connection was lost */
+    bool done;
+    pthread_cond_t *done_cond; /* Signalled when done, a hedge shares it */
+
+    /* Set when sent, protected by cfg.connections_lock */
+    struct netfs_connection *con;
+    uint32_t tag;
+    uint8_t operation;
+    uint64_t sent_us;
+    bool receiving; /* The response is being received into buf */
+
+    /* If set, a successful response is received here instead of payload. */
+    void *buf;
+    size_t buf_size;
+
+    /* If set, called on the receiver thread instead of waking a waiter. */
+    void (*complete)(struct netfs_request *);
+    void *arg;
+};
+
+struct readahead_job {
+    char *path;
+    struct stat st;
+    uint64_t index;
+    uint64_t generation; /* Of the block cache when st was fetched */
+};
+
+/*
+ * Requests are tagged with their slot in requests, a receiver thread per
+ * connection matches responses to them in whatever order they arrive.
+ */
 struct netfs_connection {
+    struct netfs_server *server;
     int sock_fd;
+    struct netfs_shm *shm; /* Carries the data instead of sock_fd */
+    pthread_mutex_t send_lock;
+
+    /* Protected by cfg.connections_lock */
+    struct netfs_request *requests[MAX_INFLIGHT];
+    unsigned int inflight;
+    /*
+     * Bits by tag. An abandoned request is gone, its slot stays taken
+     * until the response is dropped and any CANCEL for it is sent.
+     */
+    uint64_t abandoned;
+    uint64_t cancelling; /* A CANCEL is being sent */
+    uint64_t answered;   /* The response came while cancelling */
+    bool closed;
+    int refs; /* Receiver thread and senders */
+};
+
+/* A storage server, all of them export the same tree. */
+struct netfs_server {
+    struct sockaddr_storage addr;
+    socklen_t addr_size;
+    int transport; /* NETFS_TRANSPORT_ of its address */
 
-    struct netfs_connection *next;
-    struct netfs_connection *prev;
+    /* Protected by cfg.connections_lock */
+    struct netfs_connection *connections[MAX_CONNECTIONS];
+    bool connecting; /* A connection is being opened, one at a time */
+
+    /* From the last HELLO_R, the base protocol until the server answers */
+    uint32_t caps;
+    uint32_t max_request;
+    uint32_t max_read;
+    uint32_t io_size;
+};
+
+/* Where a server sits on the consistent hashing ring. */
+struct hash_point {
+    uint32_t hash;
+    int server;
 };
 
 struct netfs_config {
-    struct sockaddr_in server_addr;
+    struct netfs_server servers[MAX_SERVERS];
+    int server_count;
+    uint64_t session; /* Sent in HELLO, random so others can not guess it */
+    /* Sorted, a path belongs to the first point at or after its hash */
+    struct hash_point hash_ring[MAX_SERVERS * HASH_RING_POINTS];
 
-    struct netfs_connection *connections;
-    int connection_count;
     pthread_mutex_t connections_lock;
-    pthread_cond_t connections_cond;
+    pthread_cond_t connections_cond; /* A request slot was freed */
+    /* Protected by connections_lock */
+    struct latency_histogram latency[NETFS_OPERATIONS];
+    uint64_t hedge_candidates; /* Requests that could have been hedged */
+    uint64_t hedges;
+
+    unsigned int hedge_percentile; /* 0 disables hedging */
+
+    struct netfs_stats stats; /* Read through STATS_PATH */
+
+    double attr_ttl;
+    unsigned int attr_cache_size;
+    struct attr_cache attr_cache;
+
+    unsigned int block_cache_size;
+    struct block_cache block_cache;
+
+    unsigned int readahead;
+};
+
+#define NETFS_OPT(t, p) {t, offsetof(struct netfs_config, p), 0}
+
+static const struct fuse_opt netfs_opts[] = {
+    NETFS_OPT("attr_ttl=%lf", attr_ttl),
+    NETFS_OPT("attr_cache_size=%u", attr_cache_size),
+    NETFS_OPT("block_cache_size=%u", block_cache_size),
+    NETFS_OPT("readahead=%u", readahead),
+    NETFS_OPT("hedge=%u", hedge_percentile),
+    FUSE_OPT_END,
 };
 
 /* Function prototypes. */
-struct netfs_connection *create_connection();
-void remove_connection(struct netfs_connection *);
-struct netfs_connection *get_connection();
-void add_connection(struct netfs_connection *);
+struct netfs_connection *create_connection(struct netfs_server *server);
+void put_connection(struct netfs_connection *);
+void *connection_receiver(void *arg);
+int send_requestv(struct netfs_request *, struct iovec *iov, int iovcnt,
+                  bool wait);
+int send_request(struct netfs_request *, void *packet, size_t size,
+                 bool wait);
+int netfs_transactv(struct netfs_request *, struct iovec *iov, int iovcnt);
+int netfs_transact(struct netfs_request *, void *packet, size_t size);
+/* Fills iov with a request for server, returns the entries or -1. */
+typedef int (*prep_request_t)(int server, struct iovec *iov, void *arg);
+int netfs_transact_hedged(struct netfs_request *, prep_request_t prep,
+                          void *arg);
+
+void attr_cache_init(struct attr_cache *, unsigned int capacity, double ttl);
+bool attr_cache_lookup(struct attr_cache *, const char *path,
+                       struct stat *stbuf);
+uint64_t attr_cache_generation(struct attr_cache *);
+void attr_cache_insert(struct attr_cache *, const char *path,
+                       const struct stat *stbuf, uint64_t generation);
+void attr_cache_invalidate(struct attr_cache *, const char *path);
+
+void block_cache_init(struct block_cache *, size_t size);
+uint64_t block_cache_generation(struct block_cache *);
+void block_cache_validate(struct block_cache *, const char *path,
+                          const struct stat *stbuf);
+ssize_t block_cache_read(struct block_cache *, const char *path,
+                         uint64_t index, char *buf, size_t offset, size_t size);
+bool block_cache_reserve(struct block_cache *, const char *path,
+                         const struct stat *stbuf, uint64_t index,
+                         uint64_t generation);
+void block_cache_cancel(struct block_cache *, const char *path,
+                        uint64_t index, uint64_t generation);
+void block_cache_insert(struct block_cache *, const char *path,
+                        const struct stat *stbuf, uint64_t index,
+                        char *data, size_t length, uint64_t generation);
+void block_cache_invalidate(struct block_cache *, const char *path);
 
 /* Fuse override function prototypes. */
 static int netfs_getattr(const char *path, struct stat *stbuf);
 static int netfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi);
+static int netfs_opendir(const char *path, struct fuse_file_info *fi);
+static int netfs_releasedir(const char *path, struct fuse_file_info *fi);
+static int netfs_open(const char *path, struct fuse_file_info *fi);
 static int netfs_read(const char *path, char *buf, size_t size, off_t offset,
                       struct fuse_file_info *fi);
+static int netfs_release(const char *path, struct fuse_file_info *fi);
+static int open_remote(int server, const char *path, uint64_t *handle);
+static void prep_read_packet(uint8_t *packet, uint64_t handle, size_t size,
+                             off_t offset);
+static int file_handle(struct netfs_file *file, const char *path, int server,
+                       uint64_t stale, uint64_t *handle);
+static int read_chunk(struct netfs_file *file, const char *path, char *buf,
+                      size_t size, off_t offset);
+static int read_remote(struct netfs_file *file, const char *path, char *buf,
+                       size_t size, off_t offset);
+static void netfs_destroy(void *private_data);
 
 struct netfs_config cfg;
 
-void init(char *ip, uint16_t port)
+/* netfs_hash with the bits of similar strings spread over the whole ring */
+static uint32_t ring_hash(const char *str, size_t len)
+{
+    uint32_t hash = netfs_hash(str, len);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* address is an IPv4 address, "unix:PATH" or "shm:PATH". */
+static void add_server(char *address, uint16_t port)
+{
+    struct netfs_server *server = &cfg.servers[cfg.server_count];
+    const char *path;
+    server->transport = netfs_parse_address(address, &path);
+    if (server->transport == NETFS_TRANSPORT_TCP) {
+        struct sockaddr_in *addr = (struct sockaddr_in *)&server->addr;
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(port);
+        inet_pton(AF_INET, address, &addr->sin_addr.s_addr);
+        server->addr_size = sizeof(struct sockaddr_in);
+    } else {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&server->addr;
+        addr->sun_family = AF_UNIX;
+        strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+        server->addr_size = sizeof(struct sockaddr_un);
+    }
+    server->max_request = PATH_MAX;
+    server->max_read = BLOCK_SIZE;
+    server->io_size = BLOCK_SIZE;
+
+    /* Points depend on the address only, not on the order given. */
+    int i;
+    for (i = 0; i < HASH_RING_POINTS; i++) {
+        char point[strlen(address) + 16];
+        int length = snprintf(point, sizeof(point), "%s#%d", address, i);
+        struct hash_point *hash_point =
+            &cfg.hash_ring[cfg.server_count * HASH_RING_POINTS + i];
+        hash_point->hash = ring_hash(point, length);
+        hash_point->server = cfg.server_count;
+    }
+    cfg.server_count++;
+}
+
+static int compare_hash_points(const void *a, const void *b)
+{
+    uint32_t hash_a = ((const struct hash_point *)a)->hash;
+    uint32_t hash_b = ((const struct hash_point *)b)->hash;
+    return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
+
+/* addresses is a comma separated list of servers exporting the same tree. */
+void init(const char *addresses, uint16_t port)
 {
     memset(&cfg, 0, sizeof(struct netfs_config));
-    cfg.server_addr.sin_family = AF_INET;
-    cfg.server_addr.sin_port = htons(port);
-    inet_pton(AF_INET, ip, &cfg.server_addr.sin_addr.s_addr);
+    char *list = strdup(addresses);
+    char *saveptr;
+    char *address = strtok_r(list, ",", &saveptr);
+    for (; address != NULL && cfg.server_count < MAX_SERVERS;
+         address = strtok_r(NULL, ",", &saveptr))
+        add_server(address, port);
+    if (address != NULL)
+        fprintf(stderr, "Only the first %d servers are used\n", MAX_SERVERS);
+    free(list);
+    qsort(cfg.hash_ring, cfg.server_count * HASH_RING_POINTS,
+          sizeof(struct hash_point), compare_hash_points);
 
-    cfg.connections = NULL;
     pthread_mutex_init(&cfg.connections_lock, NULL);
     pthread_cond_init(&cfg.connections_cond, NULL);
+
+    while (cfg.session == 0) {
+        if (getrandom(&cfg.session, sizeof(cfg.session), 0) !=
+            sizeof(cfg.session)) {
+            fprintf(stderr, "getrandom failed, Error: %s\n", strerror(errno));
+            cfg.session = netfs_monotonic_us() ^ ((uint64_t)getpid() << 32);
+        }
+    }
+
+    cfg.attr_ttl = ATTR_CACHE_TTL;
+    cfg.attr_cache_size = ATTR_CACHE_SIZE;
+    cfg.block_cache_size = BLOCK_CACHE_SIZE;
+
+    cfg.readahead = READAHEAD_MAX;
+    cfg.hedge_percentile = HEDGE_PERCENTILE;
 }
 
 /* -f Foreground, -s Single Threaded */
@@ -68,254 +451,1858 @@ int main(int argc, char *argv[])
     if (argc < CLIENT_ARGUMENT_COUNT) {
         fprintf(stdout,
                 "%s: Usage: %s [optional: arguments for fuse] [mount point] "
-                "[storage address] [storage port]\n",
+                "[storage addresses: comma separated IPs, unix:PATH or "
+                "shm:PATH] [storage port]\n",
                 argv[0], argv[0]);
         return EXIT_FAILURE;
     }
     init(argv[argc - 2], atoi(argv[argc - 1]));
+    if (cfg.server_count == 0) {
+        fprintf(stderr, "No storage address given\n");
+        return EXIT_FAILURE;
+    }
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc - 2, argv);
+    if (fuse_opt_parse(&args, &cfg, netfs_opts, NULL) == -1)
+        return EXIT_FAILURE;
+    attr_cache_init(&cfg.attr_cache, cfg.attr_cache_size, cfg.attr_ttl);
+    block_cache_init(&cfg.block_cache,
+                     (size_t)cfg.block_cache_size * 1024 * 1024);
+
     struct fuse_operations netfs_oper = {
         .getattr = netfs_getattr,
         .readdir = netfs_readdir,
+        .opendir = netfs_opendir,
+        .releasedir = netfs_releasedir,
+        .open = netfs_open,
         .read = netfs_read,
+        .release = netfs_release,
+        .destroy = netfs_destroy,
     };
-    fuse_main(argc - 2, argv, &netfs_oper, NULL);
+    fuse_main(args.argc, args.argv, &netfs_oper, NULL);
+    fuse_opt_free_args(&args);
+
+    return 0;
+}
 
+/* The server holding the metadata of path, by consistent hashing. */
+static int home_server(const char *path)
+{
+    if (cfg.server_count == 1)
+        return 0;
+    uint32_t hash = ring_hash(path, strlen(path));
+    int low = 0, high = cfg.server_count * HASH_RING_POINTS;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (cfg.hash_ring[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == cfg.server_count * HASH_RING_POINTS)
+        low = 0; /* Wrap around the ring */
+    return cfg.hash_ring[low].server;
+}
+
+/* The server reading the stripe of path around offset. */
+static int stripe_server(const char *path, off_t offset)
+{
+    if (cfg.server_count == 1)
+        return 0;
+    return (home_server(path) + offset / STRIPE_SIZE) % cfg.server_count;
+}
+
+static uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Bucket 2n holds [2^n, 1.5 * 2^n) microseconds, 2n + 1 the rest. */
+static int latency_bucket(uint64_t us)
+{
+    if (us < 2)
+        return 0;
+    int log = 63 - __builtin_clzll(us);
+    int bucket = 2 * log + ((us >> (log - 1)) & 1);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/* The first latency past the bucket. */
+static uint64_t latency_bucket_limit(int bucket)
+{
+    if (bucket < 2)
+        return 2;
+    return ((uint64_t)1 << (bucket / 2 - 1)) * (3 + bucket % 2);
+}
+
+static void latency_record(struct latency_histogram *histogram, uint64_t us)
+{
+    if (histogram->total == LATENCY_WINDOW) {
+        int i;
+        histogram->total = 0;
+        for (i = 0; i < LATENCY_BUCKETS; i++) {
+            histogram->counts[i] /= 2;
+            histogram->total += histogram->counts[i];
+        }
+    }
+    histogram->counts[latency_bucket(us)]++;
+    histogram->total++;
+}
+
+/* Returns a latency at least percentile percent of the samples are below. */
+static uint64_t latency_percentile(const struct latency_histogram *histogram,
+                                   unsigned int percentile)
+{
+    uint64_t wanted = ((uint64_t)histogram->total * percentile + 99) / 100;
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        seen += histogram->counts[i];
+        if (seen >= wanted)
+            break;
+    }
+    return latency_bucket_limit(i);
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+    size_t length = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+        length += iov[i].iov_len;
+    return length;
+}
+
+/* Like sendallv on the connection's socket or ring. */
+static int con_sendallv(struct netfs_connection *con, struct iovec *iov,
+                        int iovcnt)
+{
+    size_t length = iov_length(iov, iovcnt);
+    int res = con->shm != NULL ? netfs_shm_sendallv(con->shm, iov, iovcnt)
+                               : sendallv(con->sock_fd, iov, iovcnt);
+    if (res >= 0)
+        netfs_stats_add(&cfg.stats.bytes_out, length);
+    return res;
+}
+
+/* Like recvallv on the connection's socket or ring. */
+static int con_recvallv(struct netfs_connection *con, struct iovec *iov,
+                        int iovcnt)
+{
+    size_t length = iov_length(iov, iovcnt);
+    int res = con->shm != NULL ? netfs_shm_recvallv(con->shm, iov, iovcnt)
+                               : recvallv(con->sock_fd, iov, iovcnt);
+    if (res >= 0)
+        netfs_stats_add(&cfg.stats.bytes_in, length);
+    return res;
+}
+
+static int con_recvall(struct netfs_connection *con, void *buf, size_t size)
+{
+    struct iovec iov = {buf, size};
+    return con_recvallv(con, &iov, 1);
+}
+
+/*
+ * Exchanges HELLO on a fresh connection, before its receiver starts, and
+ * records what the server supports.
+ */
+static int negotiate(struct netfs_connection *con)
+{
+    struct netfs_header header;
+    PREP_NETFS_HEADER(&header,
+                      sizeof(struct netfs_hello) +
+                          sizeof(struct netfs_hello_session),
+                      HELLO, 0);
+    struct netfs_hello hello;
+    hello.version = htonl(NETFS_VERSION);
+    hello.capabilities = htonl(NETFS_CAP_READDIRPLUS | NETFS_CAP_CANCEL |
+                               NETFS_CAP_INVALIDATE);
+    hello.max_request = 0; /* The client serves no requests */
+    hello.max_response = htonl(NETFS_MAX_BUFFER);
+    hello.io_size = htonl(BLOCK_SIZE);
+    /* Lets every connection use the handles opened on another. */
+    struct netfs_hello_session session = {htobe64(cfg.session)};
+    struct netfs_server *server = con->server;
+    struct iovec send_iov[] = {{&header, NETFS_HEADER_SIZE},
+                               {&hello, sizeof(hello)},
+                               {&session, sizeof(session)}};
+    if (con_sendallv(con, send_iov, 3) < 0)
+        return -1;
+
+    if (con_recvall(con, &header, NETFS_HEADER_SIZE) < 0)
+        return -1;
+    uint32_t length = ntohl(header.payload_length);
+    if (header.operation != HELLO_R || length < sizeof(struct netfs_hello) ||
+        length > MAX_HELLO_PAYLOAD) {
+        errno = EPROTO;
+        return -1;
+    }
+    /* Later versions may append fields. */
+    uint8_t extension[MAX_HELLO_PAYLOAD];
+    struct iovec recv_iov[] = {{&hello, sizeof(hello)},
+                               {extension, length - sizeof(hello)}};
+    if (con_recvallv(con, recv_iov, 2) < 0)
+        return -1;
+    pthread_mutex_lock(&cfg.connections_lock);
+    server->caps = ntohl(hello.capabilities);
+    server->max_request = ntohl(hello.max_request);
+    server->max_read = ntohl(hello.max_response);
+    if (server->max_read > NETFS_MAX_BUFFER)
+        server->max_read = NETFS_MAX_BUFFER;
+    server->io_size = ntohl(hello.io_size);
+    pthread_mutex_unlock(&cfg.connections_lock);
     return 0;
 }
 
-struct netfs_connection *create_connection()
+/*
+ * Returns NULL if the server can not be reached. The receiver is started
+ * by add_connection. Must be called without cfg.connections_lock held, a
+ * stalled server would hold up every request.
+ */
+struct netfs_connection *create_connection(struct netfs_server *server)
 {
-    struct netfs_connection *new_con = malloc(sizeof(struct netfs_connection));
+    struct netfs_connection *new_con =
+        calloc(1, sizeof(struct netfs_connection));
+    new_con->server = server;
 
-    if ((new_con->sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((new_con->sock_fd = socket(server->addr.ss_family, SOCK_STREAM, 0)) <
+        0) {
         fprintf(stderr, "Socket creation failed! Error: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        free(new_con);
+        return NULL;
     }
 
-    if (connect(new_con->sock_fd, (struct sockaddr *)&cfg.server_addr,
-                sizeof(struct sockaddr_in)) < 0) {
+    if (connect(new_con->sock_fd, (struct sockaddr *)&server->addr,
+                server->addr_size) < 0) {
         fprintf(stderr, "Could not connect %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        close(new_con->sock_fd);
+        free(new_con);
+        return NULL;
+    }
+    if (server->transport == NETFS_TRANSPORT_SHM &&
+        (new_con->shm = netfs_shm_attach(new_con->sock_fd)) == NULL) {
+        fprintf(stderr, "Shared memory setup failed %s\n", strerror(errno));
+        close(new_con->sock_fd);
+        free(new_con);
+        return NULL;
+    }
+    if (negotiate(new_con) < 0) {
+        fprintf(stderr, "Handshake failed %s\n", strerror(errno));
+        if (new_con->shm != NULL)
+            netfs_shm_free(new_con->shm);
+        close(new_con->sock_fd);
+        free(new_con);
+        return NULL;
     }
 
-    cfg.connection_count++;
+    pthread_mutex_init(&new_con->send_lock, NULL);
+    new_con->refs = 1;
     return new_con;
 }
 
-void remove_connection(struct netfs_connection *con)
+/*
+ * Ends the server's connecting, puts the new connection, if any, in a free
+ * slot and starts its receiver. Must be called with cfg.connections_lock
+ * held.
+ */
+static void add_connection(struct netfs_server *server,
+                           struct netfs_connection *con)
+{
+    server->connecting = false;
+    pthread_cond_broadcast(&cfg.connections_cond);
+    if (con == NULL)
+        return;
+    int i;
+    for (i = 0; server->connections[i] != NULL; i++)
+        ; /* Slots are only filled by whoever is connecting */
+    server->connections[i] = con;
+    pthread_t t;
+    pthread_create(&t, NULL, connection_receiver, (void *)con);
+    pthread_detach(t);
+}
+
+/* Opens another connection to the server for later requests. */
+static void *connect_thread(void *arg)
 {
+    struct netfs_server *server = (struct netfs_server *)arg;
+    struct netfs_connection *con = create_connection(server);
     pthread_mutex_lock(&cfg.connections_lock);
-    close(con->sock_fd);
-    free(con);
-    cfg.connection_count--;
+    add_connection(server, con);
     pthread_mutex_unlock(&cfg.connections_lock);
+    return NULL;
 }
 
-struct netfs_connection *get_connection()
+void put_connection(struct netfs_connection *con)
 {
-    struct netfs_connection *con = NULL;
     pthread_mutex_lock(&cfg.connections_lock);
-    if (cfg.connections == NULL) {
-        if (cfg.connection_count < MAX_CONNECTIONS) {
-            con = create_connection();
+    int refs = --con->refs;
+    pthread_mutex_unlock(&cfg.connections_lock);
+    if (refs == 0) {
+        if (con->shm != NULL)
+            netfs_shm_free(con->shm);
+        close(con->sock_fd);
+        pthread_mutex_destroy(&con->send_lock);
+        free(con);
+    }
+}
+
+/* Must be called with cfg.connections_lock held. */
+static void free_slot(struct netfs_connection *con, uint32_t tag)
+{
+    con->requests[tag] = NULL;
+    con->inflight--;
+    pthread_cond_broadcast(&cfg.connections_cond);
+}
+
+/*
+ * The response of an abandoned request was dropped. Must be called with
+ * cfg.connections_lock held.
+ */
+static void answer_abandoned(struct netfs_connection *con, uint32_t tag)
+{
+    uint64_t bit = (uint64_t)1 << tag;
+    if (con->cancelling & bit) {
+        /* A later request must not get the tag before the CANCEL is out. */
+        con->answered |= bit;
+        return;
+    }
+    con->abandoned &= ~bit;
+    con->answered &= ~bit;
+    free_slot(con, tag);
+}
+
+/* Must be called with cfg.connections_lock held. */
+static void complete_request(struct netfs_connection *con, uint32_t tag,
+                             int status)
+{
+    if (con->abandoned & ((uint64_t)1 << tag)) {
+        answer_abandoned(con, tag);
+        return;
+    }
+    struct netfs_request *req = con->requests[tag];
+    free_slot(con, tag);
+
+    req->status = status;
+    uint64_t latency = netfs_monotonic_us() - req->sent_us;
+    netfs_stats_record(&cfg.stats, req->operation, latency,
+                       status < 0 || req->header.operation == ERROR);
+    if (status == 0 && req->operation < NETFS_OPERATIONS)
+        latency_record(&cfg.latency[req->operation], latency);
+    if (req->complete != NULL) {
+        /* Completion handlers may issue new requests. */
+        pthread_mutex_unlock(&cfg.connections_lock);
+        req->complete(req);
+        pthread_mutex_lock(&cfg.connections_lock);
+    } else {
+        req->done = true;
+        pthread_cond_broadcast(req->done_cond);
+    }
+}
+
+/* Returns -1 if the connection is lost or the response is malformed. */
+static int receive_payload(struct netfs_connection *con,
+                           struct netfs_request *req)
+{
+    uint32_t length = req->header.payload_length;
+    if (req->header.operation == ERROR) {
+        uint8_t scratch[MAX_ERROR_PAYLOAD];
+        if (length < sizeof(uint32_t) || length > MAX_ERROR_PAYLOAD) {
+            fprintf(stderr, "Malformed error response\n");
+            return -1;
+        }
+        if (con_recvall(con, scratch, length) < 0) {
+            fprintf(stderr, "Connection Lost %s\n", strerror(errno));
+            return -1;
+        }
+        req->error = ntohl(*(uint32_t *)scratch);
+        return 0;
+    }
+
+    void *dest = req->buf;
+    if (dest == NULL) {
+        if (length > NETFS_MAX_BUFFER) {
+            fprintf(stderr, "Response too large: %u\n", length);
+            return -1;
+        }
+        dest = req->payload = netfs_buf_alloc(length);
+    } else if (length > req->buf_size) {
+        fprintf(stderr, "Response larger than requested: %u\n", length);
+        return -1;
+    }
+    if (con_recvall(con, dest, length) < 0) {
+        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
+        netfs_buf_free(req->payload);
+        req->payload = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Drops what the client caches of path and below, everything for "". */
+static void invalidate(const char *path)
+{
+    attr_cache_invalidate(&cfg.attr_cache, path);
+    block_cache_invalidate(&cfg.block_cache, path);
+}
+
+/* The payload of an INVALIDATE push is the path. */
+static int receive_invalidate(struct netfs_connection *con,
+                              const struct netfs_header *header)
+{
+    char path[PATH_MAX];
+    if (header->payload_length >= PATH_MAX) {
+        fprintf(stderr, "Malformed invalidation\n");
+        return -1;
+    }
+    if (con_recvall(con, path, header->payload_length) < 0) {
+        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
+        return -1;
+    }
+    path[header->payload_length] = '\0';
+    invalidate(path);
+    return 0;
+}
+
+void *connection_receiver(void *arg)
+{
+    struct netfs_connection *con = (struct netfs_connection *)arg;
+
+    struct netfs_header header;
+    while (true) {
+        if (con_recvall(con, &header, NETFS_HEADER_SIZE) < 0) {
+            fprintf(stderr, "Connection Lost %s\n", strerror(errno));
+            break;
+        }
+        header.payload_length = ntohl(header.payload_length);
+        header.tag = ntohl(header.tag);
+
+        if (header.operation == INVALIDATE) {
+            if (receive_invalidate(con, &header) < 0)
+                break;
+            continue;
+        }
+
+        /*
+         * Only this thread clears slots and a request being received is
+         * not abandoned, so req stays valid unlocked.
+         */
+        pthread_mutex_lock(&cfg.connections_lock);
+        struct netfs_request *req =
+            header.tag < MAX_INFLIGHT ? con->requests[header.tag] : NULL;
+        bool abandoned =
+            req != NULL && (con->abandoned & ((uint64_t)1 << header.tag));
+        if (req != NULL && !abandoned)
+            req->receiving = true;
+        pthread_mutex_unlock(&cfg.connections_lock);
+        if (req == NULL) {
+            fprintf(stderr, "Response with unknown tag %u\n", header.tag);
+            break;
+        }
+
+        if (abandoned) {
+            struct netfs_request dropped = {.header = header};
+            if (receive_payload(con, &dropped) < 0)
+                break;
+            netfs_buf_free(dropped.payload);
         } else {
+            req->header = header;
+            if (receive_payload(con, req) < 0)
+                break;
+        }
+
+        pthread_mutex_lock(&cfg.connections_lock);
+        complete_request(con, header.tag, 0);
+        pthread_mutex_unlock(&cfg.connections_lock);
+    }
+
+    /* Fail everything in flight and let the next request reconnect. */
+    shutdown(con->sock_fd, SHUT_RDWR);
+    pthread_mutex_lock(&cfg.connections_lock);
+    con->closed = true;
+    int i;
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (con->server->connections[i] == con)
+            con->server->connections[i] = NULL;
+    }
+    uint32_t tag;
+    for (tag = 0; tag < MAX_INFLIGHT; tag++) {
+        if (con->requests[tag] != NULL)
+            complete_request(con, tag, -1);
+    }
+    bool leased = con->server->caps & NETFS_CAP_INVALIDATE;
+    pthread_mutex_unlock(&cfg.connections_lock);
+    /* Invalidations may have been lost with the connection. */
+    if (leased)
+        invalidate("");
+    put_connection(con);
+    return NULL;
+}
+
+/*
+ * Sends a request gathered from iov, whose first entry is the header, on
+ * the least loaded connection to req->server. The tag in the header is
+ * filled in here. If
+ * all connections are busy this waits for a free slot, or fails when wait
+ * is false. Returns -1 if the request could not be sent, otherwise req is
+ * completed by the receiver thread. The entries of iov are consumed.
+ */
+int send_requestv(struct netfs_request *req, struct iovec *iov, int iovcnt,
+                  bool wait)
+{
+    struct netfs_server *server = &cfg.servers[req->server];
+    struct netfs_connection **connections = server->connections;
+    struct netfs_connection *con = NULL;
+    uint32_t tag;
+    size_t size = iov_length(iov, iovcnt);
+    int i;
+    bool connected = false;
+    uint64_t wait_start = 0; /* Set while waiting for a connection slot */
+    pthread_mutex_lock(&cfg.connections_lock);
+    while (true) {
+        bool full = true;
+        for (i = 0; i < MAX_CONNECTIONS; i++) {
+            if (connections[i] == NULL)
+                full = false;
+            else if (con == NULL || connections[i]->inflight < con->inflight)
+                con = connections[i];
+        }
+        if (con == NULL && server->connecting && wait) {
+            if (wait_start == 0)
+                wait_start = netfs_monotonic_us();
             pthread_cond_wait(&cfg.connections_cond, &cfg.connections_lock);
-            con = cfg.connections;
-            DL_DELETE(cfg.connections, con);
+            continue;
         }
-    } else {
-        con = cfg.connections;
-        DL_DELETE(cfg.connections, con);
+        if (con == NULL && !server->connecting && !connected) {
+            server->connecting = true;
+            pthread_mutex_unlock(&cfg.connections_lock);
+            struct netfs_connection *new_con = create_connection(server);
+            pthread_mutex_lock(&cfg.connections_lock);
+            add_connection(server, new_con);
+            connected = true;
+            continue;
+        }
+        if (con == NULL) {
+            pthread_mutex_unlock(&cfg.connections_lock);
+            return -1;
+        }
+        if (!full && con->inflight > 0 && !server->connecting) {
+            /* All are busy, open one more lazily without waiting for it. */
+            server->connecting = true;
+            pthread_t t;
+            pthread_create(&t, NULL, connect_thread, (void *)server);
+            pthread_detach(t);
+        }
+        if (size - NETFS_HEADER_SIZE > server->max_request) {
+            fprintf(stderr, "Request too large: %zu\n", size);
+            pthread_mutex_unlock(&cfg.connections_lock);
+            return -1;
+        }
+        if (con->inflight < MAX_INFLIGHT)
+            break;
+        if (!wait) {
+            pthread_mutex_unlock(&cfg.connections_lock);
+            return -1;
+        }
+        con = NULL;
+        if (wait_start == 0)
+            wait_start = netfs_monotonic_us();
+        pthread_cond_wait(&cfg.connections_cond, &cfg.connections_lock);
     }
+    if (wait_start != 0) {
+        netfs_stats_add(&cfg.stats.waits, 1);
+        netfs_stats_add(&cfg.stats.wait_us, netfs_monotonic_us() - wait_start);
+    }
+    for (tag = 0; con->requests[tag] != NULL; tag++)
+        ;
+    con->requests[tag] = req;
+    con->inflight++;
+    con->refs++;
+    req->done = false;
+    req->payload = NULL;
+    req->error = 0;
+    req->con = con;
+    req->tag = tag;
+    req->operation = ((struct netfs_header *)iov[0].iov_base)->operation;
+    req->sent_us = netfs_monotonic_us();
+    req->receiving = false;
     pthread_mutex_unlock(&cfg.connections_lock);
+
+    ((struct netfs_header *)iov[0].iov_base)->tag = htonl(tag);
+    pthread_mutex_lock(&con->send_lock);
+    if (con_sendallv(con, iov, iovcnt) < 0) {
+        /* The receiver notices too and fails req. */
+        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
+        shutdown(con->sock_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&con->send_lock);
+    put_connection(con);
+    return 0;
+}
+
+/* send_requestv for a request in one contiguous packet. */
+int send_request(struct netfs_request *req, void *packet, size_t size,
+                 bool wait)
+{
+    struct iovec iov = {packet, size};
+    return send_requestv(req, &iov, 1, wait);
+}
+
+/*
+ * Sends the request in iov and waits for the response. Returns -1 if the
+ * connection was lost, otherwise the response is in req and its payload
+ * must be freed. req->buf and req->buf_size must be set by the caller.
+ */
+int netfs_transactv(struct netfs_request *req, struct iovec *iov, int iovcnt)
+{
+    pthread_cond_t done_cond;
+    req->complete = NULL;
+    req->done_cond = &done_cond;
+    pthread_cond_init(&done_cond, NULL);
+    if (send_requestv(req, iov, iovcnt, true) < 0) {
+        pthread_cond_destroy(&done_cond);
+        return -1;
+    }
+    pthread_mutex_lock(&cfg.connections_lock);
+    while (!req->done)
+        pthread_cond_wait(&done_cond, &cfg.connections_lock);
+    pthread_mutex_unlock(&cfg.connections_lock);
+    pthread_cond_destroy(&done_cond);
+    return req->status;
+}
+
+int netfs_transact(struct netfs_request *req, void *packet, size_t size)
+{
+    struct iovec iov = {packet, size};
+    return netfs_transactv(req, &iov, 1);
+}
+
+/*
+ * Returns how long req may wait for its response before it is hedged, 0
+ * if it is not to be. Must be called with cfg.connections_lock held.
+ */
+static uint64_t hedge_delay(struct netfs_request *req)
+{
+    if (cfg.server_count == 1 || cfg.hedge_percentile == 0)
+        return 0;
+    if (cfg.hedge_candidates == HEDGE_WINDOW) {
+        cfg.hedge_candidates /= 2;
+        cfg.hedges /= 2;
+    }
+    cfg.hedge_candidates++;
+    struct latency_histogram *histogram = &cfg.latency[req->operation];
+    if (histogram->total < HEDGE_MIN_SAMPLES)
+        return 0;
+    uint64_t delay = latency_percentile(histogram, cfg.hedge_percentile);
+    return delay > HEDGE_MIN_DELAY ? delay : HEDGE_MIN_DELAY;
+}
+
+/*
+ * Gives up on req, its response is dropped if it still comes. If that is
+ * already being received, waits for it instead. Returns the connection to
+ * send a CANCEL for req on, with a reference, or NULL. Must be called with
+ * cfg.connections_lock held.
+ */
+static struct netfs_connection *abandon_request(struct netfs_request *req)
+{
+    while (req->receiving && !req->done)
+        pthread_cond_wait(req->done_cond, &cfg.connections_lock);
+    if (req->done)
+        return NULL;
+    struct netfs_connection *con = req->con;
+    uint64_t bit = (uint64_t)1 << req->tag;
+    con->abandoned |= bit;
+    if (con->closed || !(con->server->caps & NETFS_CAP_CANCEL))
+        return NULL;
+    con->cancelling |= bit;
+    con->refs++;
     return con;
 }
 
-void add_connection(struct netfs_connection *con)
+/* Asks the server to drop the abandoned request with tag if still queued. */
+static void send_cancel(struct netfs_connection *con, uint32_t tag)
 {
+    struct netfs_header header;
+    PREP_NETFS_HEADER(&header, 0, CANCEL, tag);
+    struct iovec iov = {&header, NETFS_HEADER_SIZE};
+    pthread_mutex_lock(&con->send_lock);
+    if (con_sendallv(con, &iov, 1) < 0) {
+        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
+        shutdown(con->sock_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&con->send_lock);
+
     pthread_mutex_lock(&cfg.connections_lock);
-    DL_APPEND(cfg.connections, con);
-    pthread_cond_signal(&cfg.connections_cond);
+    uint64_t bit = (uint64_t)1 << tag;
+    con->cancelling &= ~bit;
+    if (con->answered & bit)
+        answer_abandoned(con, tag);
     pthread_mutex_unlock(&cfg.connections_lock);
+    put_connection(con);
 }
 
-static int netfs_getattr(const char *path, struct stat *stbuf)
+/* Errors from a hedge, a handle stale there say, are left to the original. */
+static bool hedge_won(struct netfs_request *hedge)
 {
-    memset(stbuf, 0, sizeof(struct stat));
+    return hedge->done && hedge->status == 0 &&
+           hedge->header.operation != ERROR;
+}
 
-    uint32_t send_payload_length = strlen(path);
-    uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
-    PREP_NETFS_HEADER(send_packet, send_payload_length, GETATTR);
+/*
+ * Like netfs_transactv for the request prep fills in for req->server. If
+ * that is not answered within the hedge delay, the request prep fills in
+ * for the next server is sent too. The first answer is taken and the
+ * other request abandoned and cancelled, unless the first connection
+ * failed. Then the call fails only if the hedge does too. Only for
+ * requests that change nothing on the servers.
+ */
+int netfs_transact_hedged(struct netfs_request *req, prep_request_t prep,
+                          void *arg)
+{
+    struct iovec iov[2];
+    int iovcnt = prep(req->server, iov, arg);
+    if (iovcnt < 0)
+        return -1;
 
-    strncpy(NETFS_PAYLOAD(send_packet), path, send_payload_length);
+    pthread_cond_t done_cond;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&done_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    req->complete = NULL;
+    req->done_cond = &done_cond;
+    if (send_requestv(req, iov, iovcnt, true) < 0) {
+        pthread_cond_destroy(&done_cond);
+        return -1;
+    }
 
-    struct netfs_connection *con = get_connection();
-    struct netfs_header recv_packet_header;
-    if (sendall(con->sock_fd, send_packet,
-                NETFS_PACKET_SIZE(send_payload_length)) < 0) {
-        printf("Connection Lost %s\n", strerror(errno));
-        remove_connection(con);
-        return -ENOENT;
+    struct netfs_request hedge = {
+        .server = (req->server + 1) % cfg.server_count,
+        .done_cond = &done_cond};
+    bool hedged = false;
+    pthread_mutex_lock(&cfg.connections_lock);
+    uint64_t delay = hedge_delay(req);
+    if (delay > 0) {
+        uint64_t deadline_us = req->sent_us + delay;
+        struct timespec deadline = {deadline_us / 1000000,
+                                    deadline_us % 1000000 * 1000};
+        while (!req->done &&
+               pthread_cond_timedwait(&done_cond, &cfg.connections_lock,
+                                      &deadline) != ETIMEDOUT)
+            ;
+        hedged = !req->done &&
+                 cfg.hedges * 100 < cfg.hedge_candidates * HEDGE_BUDGET;
+        if (hedged)
+            cfg.hedges++;
     }
-    if (recvall(con->sock_fd, &recv_packet_header, NETFS_HEADER_SIZE) < 0) {
-        printf("Connection Lost %s\n", strerror(errno));
-        remove_connection(con);
-        return -ENOENT;
+    pthread_mutex_unlock(&cfg.connections_lock);
+
+    if (hedged) {
+        if (req->buf != NULL) {
+            /* req->buf may still be received into, the copy gets its own. */
+            hedge.buf = netfs_buf_alloc(req->buf_size);
+            hedge.buf_size = req->buf_size;
+        }
+        iovcnt = prep(hedge.server, iov, arg);
+        hedged = iovcnt > 0 && send_requestv(&hedge, iov, iovcnt, false) == 0;
     }
 
-    if (recv_packet_header.operation != GETATTR_R &&
-        recv_packet_header.operation != ERROR) {
-        fprintf(stderr, "Unknown packet in GETATTR %d\n",
-                recv_packet_header.operation);
+    pthread_mutex_lock(&cfg.connections_lock);
+    while (!(req->done && (req->status == 0 || !hedged || hedge.done)) &&
+           !(hedged && hedge_won(&hedge)))
+        pthread_cond_wait(&done_cond, &cfg.connections_lock);
+    /* The hedge's own errors only stand in for a failed connection. */
+    bool hedge_answered = hedged && hedge.done && hedge.status == 0 &&
+                          !(req->done && req->status == 0);
+    struct netfs_request *loser = hedge_answered ? req : &hedge;
+    struct netfs_connection *cancel_con = NULL;
+    if (hedged)
+        cancel_con = abandon_request(loser);
+    pthread_mutex_unlock(&cfg.connections_lock);
+    if (cancel_con != NULL)
+        send_cancel(cancel_con, loser->tag);
+
+    if (hedged && loser == req) {
+        netfs_buf_free(req->payload);
+        req->header = hedge.header;
+        req->payload = hedge.payload;
+        req->error = hedge.error;
+        req->status = hedge.status;
+        if (req->buf != NULL)
+            memcpy(req->buf, hedge.buf, hedge.header.payload_length);
+    } else if (hedged) {
+        netfs_buf_free(hedge.payload);
+    }
+    netfs_buf_free(hedge.buf);
+    pthread_cond_destroy(&done_cond);
+    return req->status;
+}
+
+void attr_cache_init(struct attr_cache *cache, unsigned int capacity,
+                     double ttl)
+{
+    memset(cache, 0, sizeof(struct attr_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    if (capacity == 0 || ttl <= 0)
+        return;
+
+    /* Keep the load factor at or below one. */
+    uint32_t bucket_count = 1;
+    while (bucket_count < capacity)
+        bucket_count <<= 1;
+    cache->buckets = calloc(bucket_count, sizeof(struct attr_cache_entry *));
+    cache->bucket_mask = bucket_count - 1;
+    cache->capacity = capacity;
+    cache->ttl = ttl * 1000;
+}
+
+/* Must be called with cache->lock held. */
+static struct attr_cache_entry *attr_cache_find(struct attr_cache *cache,
+                                                const char *path, uint32_t hash)
+{
+    struct attr_cache_entry *entry;
+    DL_FOREACH2(cache->buckets[hash & cache->bucket_mask], entry, hnext) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0)
+            return entry;
     }
+    return NULL;
+}
 
-    recv_packet_header.payload_length =
-        ntohl(recv_packet_header.payload_length);
-    uint8_t recv_packet_payload[recv_packet_header.payload_length];
-    if (recvall(con->sock_fd, &recv_packet_payload,
-                recv_packet_header.payload_length) < 0) {
-        printf("Connection Lost %s\n", strerror(errno));
-        remove_connection(con);
-        return -ENOENT;
+/* Must be called with cache->lock held. */
+static void attr_cache_remove(struct attr_cache *cache,
+                              struct attr_cache_entry *entry)
+{
+    DL_DELETE2(cache->buckets[entry->hash & cache->bucket_mask], entry, hprev,
+               hnext);
+    DL_DELETE(cache->lru, entry);
+    cache->count--;
+    free(entry->path);
+    free(entry);
+}
+
+bool attr_cache_lookup(struct attr_cache *cache, const char *path,
+                       struct stat *stbuf)
+{
+    if (cache->ttl == 0)
+        return false;
+
+    uint32_t hash = netfs_hash(path, strlen(path));
+    bool found = false;
+    pthread_mutex_lock(&cache->lock);
+    struct attr_cache_entry *entry = attr_cache_find(cache, path, hash);
+    if (entry != NULL && entry->expires <= monotonic_ms()) {
+        attr_cache_remove(cache, entry);
+        entry = NULL;
     }
-    if (recv_packet_header.operation == ERROR) {
-        errno = ntohl(*(uint32_t *)recv_packet_payload);
-        add_connection(con);
-        return -errno;
+    if (entry != NULL) {
+        memcpy(stbuf, &entry->st, sizeof(struct stat));
+        DL_DELETE(cache->lru, entry);
+        DL_APPEND(cache->lru, entry);
+        cache->hits++;
+        found = true;
     } else {
-        struct netfs_attrs *attrs = (struct netfs_attrs *)recv_packet_payload;
-        stbuf->st_mode = ntohl(attrs->mode);
-        stbuf->st_nlink = ntohl(attrs->nlink);
-        stbuf->st_uid = ntohl(attrs->uid);
-        stbuf->st_gid = ntohl(attrs->gid);
-        stbuf->st_size = ntohl(attrs->size);
-        stbuf->st_atime = ntohl(attrs->atime);
-        stbuf->st_mtime = ntohl(attrs->mtime);
-        stbuf->st_ctime = ntohl(attrs->ctime);
-        add_connection(con);
-        return 0;
+        cache->misses++;
     }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
 }
 
-static int netfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset, struct fuse_file_info *fi)
+/* Whether path is prefix or below it, "" and "/" contain every path. */
+static bool path_within(const char *path, const char *prefix)
 {
-    uint32_t send_payload_length = strlen(path);
-    uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
-    PREP_NETFS_HEADER(send_packet, send_payload_length, READDIR);
-    strncpy(NETFS_PAYLOAD(send_packet), path, send_payload_length);
+    size_t length = strlen(prefix);
+    if (length > 0 && prefix[length - 1] == '/')
+        length--;
+    return strncmp(path, prefix, length) == 0 &&
+           (path[length] == '\0' || path[length] == '/');
+}
 
-    struct netfs_connection *con = get_connection();
-    struct netfs_header recv_packet_header;
-    if (sendall(con->sock_fd, send_packet,
-                NETFS_PACKET_SIZE(send_payload_length)) < 0) {
-        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
-        remove_connection(con);
-        return -ENOENT;
+/* Taken before fetching what is inserted, which an invalidation outdates. */
+uint64_t attr_cache_generation(struct attr_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    uint64_t generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+    return generation;
+}
+
+void attr_cache_insert(struct attr_cache *cache, const char *path,
+                       const struct stat *stbuf, uint64_t generation)
+{
+    if (cache->ttl == 0)
+        return;
+
+    uint32_t hash = netfs_hash(path, strlen(path));
+    pthread_mutex_lock(&cache->lock);
+    if (generation != cache->generation) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
     }
-    if (recvall(con->sock_fd, &recv_packet_header, NETFS_HEADER_SIZE) < 0) {
-        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
-        remove_connection(con);
-        return -ENOENT;
+    struct attr_cache_entry *entry = attr_cache_find(cache, path, hash);
+    if (entry == NULL) {
+        if (cache->count >= cache->capacity) {
+            attr_cache_remove(cache, cache->lru);
+            cache->evictions++;
+        }
+        entry = malloc(sizeof(struct attr_cache_entry));
+        entry->path = strdup(path);
+        entry->hash = hash;
+        DL_APPEND2(cache->buckets[hash & cache->bucket_mask], entry, hprev,
+                   hnext);
+        cache->count++;
+    } else {
+        DL_DELETE(cache->lru, entry);
     }
+    DL_APPEND(cache->lru, entry);
+    memcpy(&entry->st, stbuf, sizeof(struct stat));
+    entry->expires = monotonic_ms() + cache->ttl;
+    pthread_mutex_unlock(&cache->lock);
+}
 
-    if (recv_packet_header.operation != READDIR_R &&
-        recv_packet_header.operation != ERROR) {
-        fprintf(stderr, "Unknown packet in READDIR %d\n",
-                recv_packet_header.operation);
+/* Drops path and everything below it, everything for "". */
+void attr_cache_invalidate(struct attr_cache *cache, const char *path)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+    struct attr_cache_entry *entry, *tmp;
+    DL_FOREACH_SAFE(cache->lru, entry, tmp) {
+        if (path_within(entry->path, path))
+            attr_cache_remove(cache, entry);
     }
+    pthread_mutex_unlock(&cache->lock);
+}
 
-    recv_packet_header.payload_length =
-        ntohl(recv_packet_header.payload_length);
-    uint8_t recv_packet_payload[recv_packet_header.payload_length];
-    if (recvall(con->sock_fd, recv_packet_payload,
-                recv_packet_header.payload_length) < 0) {
-        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
-        remove_connection(con);
-        return -ENOENT;
+void block_cache_init(struct block_cache *cache, size_t size)
+{
+    memset(cache, 0, sizeof(struct block_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->filled, NULL);
+    if (size < BLOCK_SIZE)
+        return;
+
+    cache->capacity = size / BLOCK_SIZE;
+    uint32_t bucket_count = 1;
+    while (bucket_count < cache->capacity)
+        bucket_count <<= 1;
+    cache->file_buckets =
+        calloc(bucket_count, sizeof(struct block_cache_file *));
+    cache->block_buckets =
+        calloc(bucket_count, sizeof(struct block_cache_block *));
+    cache->bucket_mask = bucket_count - 1;
+}
+
+static uint32_t block_hash(struct block_cache_file *file, uint64_t index)
+{
+    return file->hash ^ (uint32_t)(index * 2654435761u);
+}
+
+/* Must be called with cache->lock held. */
+static struct block_cache_file *
+block_cache_find_file(struct block_cache *cache, const char *path,
+                      uint32_t hash)
+{
+    struct block_cache_file *file;
+    DL_FOREACH2(cache->file_buckets[hash & cache->bucket_mask], file, hnext) {
+        if (file->hash == hash && strcmp(file->path, path) == 0)
+            return file;
     }
-    if (recv_packet_header.operation == ERROR) {
-        errno = ntohl(*(uint32_t *)recv_packet_payload);
-        add_connection(con);
-        return -errno;
+    return NULL;
+}
+
+/* Must be called with cache->lock held. */
+static struct block_cache_block *
+block_cache_find_block(struct block_cache *cache,
+                       struct block_cache_file *file, uint64_t index)
+{
+    struct block_cache_block *block;
+    uint32_t hash = block_hash(file, index);
+    DL_FOREACH2(cache->block_buckets[hash & cache->bucket_mask], block,
+                hnext) {
+        if (block->file == file && block->index == index)
+            return block;
+    }
+    return NULL;
+}
+
+/* Must be called with cache->lock held. Frees the file with its last block. */
+static void block_cache_remove(struct block_cache *cache,
+                               struct block_cache_block *block)
+{
+    struct block_cache_file *file = block->file;
+    DL_DELETE2(cache->block_buckets[block->hash & cache->bucket_mask], block,
+               hprev, hnext);
+    DL_DELETE2(file->blocks, block, fprev, fnext);
+    if (block->pending) {
+        pthread_cond_broadcast(&cache->filled);
     } else {
-        char *d_names = (char *)recv_packet_payload;
-        uint8_t dname_len = 0;
-        int i = 0;
-        for (; i < recv_packet_header.payload_length; i += dname_len + 1) {
-            dname_len = d_names[i];
-            char dname[dname_len + 1];
-            dname[dname_len] = '\0';
-            strncpy(dname, &d_names[i] + 1, dname_len);
-            filler(buf, (const char *)dname, NULL, 0);
+        DL_DELETE(cache->lru, block);
+        cache->count--;
+    }
+    netfs_buf_free(block->data);
+    free(block);
+
+    if (file->blocks == NULL) {
+        DL_DELETE2(cache->file_buckets[file->hash & cache->bucket_mask], file,
+                   hprev, hnext);
+        free(file->path);
+        free(file);
+    }
+}
+
+static bool block_cache_same_version(struct block_cache_file *file,
+                                     const struct stat *stbuf)
+{
+    return file->mtime == stbuf->st_mtime && file->size == stbuf->st_size;
+}
+
+/*
+ * Must be called with cache->lock held, file is NULL or holds the stbuf
+ * version of path. Adds a pending block that is not yet readable or evictable.
+ */
+static struct block_cache_block *
+block_cache_add(struct block_cache *cache, struct block_cache_file *file,
+                const char *path, uint32_t hash, const struct stat *stbuf,
+                uint64_t index, uint64_t generation)
+{
+    if (file == NULL) {
+        file = malloc(sizeof(struct block_cache_file));
+        file->path = strdup(path);
+        file->hash = hash;
+        file->mtime = stbuf->st_mtime;
+        file->size = stbuf->st_size;
+        file->blocks = NULL;
+        DL_APPEND2(cache->file_buckets[hash & cache->bucket_mask], file, hprev,
+                   hnext);
+    }
+
+    struct block_cache_block *block = malloc(sizeof(struct block_cache_block));
+    block->file = file;
+    block->index = index;
+    block->hash = block_hash(file, index);
+    block->pending = true;
+    block->generation = generation;
+    block->length = 0;
+    block->data = NULL;
+    DL_APPEND2(cache->block_buckets[block->hash & cache->bucket_mask], block,
+               hprev, hnext);
+    DL_APPEND2(file->blocks, block, fprev, fnext);
+    return block;
+}
+
+uint64_t block_cache_generation(struct block_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    uint64_t generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+    return generation;
+}
+
+/* Drops cached blocks of path if they belong to another version of it. */
+void block_cache_validate(struct block_cache *cache, const char *path,
+                          const struct stat *stbuf)
+{
+    if (cache->capacity == 0)
+        return;
+
+    uint32_t hash = netfs_hash(path, strlen(path));
+    pthread_mutex_lock(&cache->lock);
+    struct block_cache_file *file = block_cache_find_file(cache, path, hash);
+    if (file != NULL && !block_cache_same_version(file, stbuf)) {
+        struct block_cache_block *block, *tmp;
+        DL_FOREACH_SAFE2(file->blocks, block, tmp, fnext) {
+            block_cache_remove(cache, block);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Copies up to size bytes starting at offset within block index of path,
+ * waiting for the block if it is being fetched. Returns the number of bytes
+ * copied, or -1 if the block is not cached.
+ */
+ssize_t block_cache_read(struct block_cache *cache, const char *path,
+                         uint64_t index, char *buf, size_t offset, size_t size)
+{
+    if (cache->capacity == 0)
+        return -1;
+
+    uint32_t hash = netfs_hash(path, strlen(path));
+    ssize_t copied = -1;
+    pthread_mutex_lock(&cache->lock);
+    struct block_cache_file *file;
+    struct block_cache_block *block;
+    while (true) {
+        file = block_cache_find_file(cache, path, hash);
+        block =
+            file == NULL ? NULL : block_cache_find_block(cache, file, index);
+        if (block == NULL || !block->pending)
+            break;
+        pthread_cond_wait(&cache->filled, &cache->lock);
+    }
+    if (block != NULL) {
+        copied = 0;
+        if (offset < block->length) {
+            copied = block->length - offset < size ? block->length - offset
+                                                   : size;
+            memcpy(buf, block->data + offset, copied);
         }
-        add_connection(con);
+        DL_DELETE(cache->lru, block);
+        DL_APPEND(cache->lru, block);
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return copied;
+}
+
+/*
+ * Claims block index of the stbuf version of path for fetching. Returns false
+ * if it is already cached or being fetched. A successful reservation must be
+ * completed with block_cache_insert or block_cache_cancel.
+ */
+bool block_cache_reserve(struct block_cache *cache, const char *path,
+                         const struct stat *stbuf, uint64_t index,
+                         uint64_t generation)
+{
+    if (cache->capacity == 0)
+        return false;
+
+    uint32_t hash = netfs_hash(path, strlen(path));
+    bool reserved = false;
+    pthread_mutex_lock(&cache->lock);
+    struct block_cache_file *file = block_cache_find_file(cache, path, hash);
+    if (generation != cache->generation) {
+        /* stbuf may be outdated */
+    } else if (file == NULL ||
+               (block_cache_same_version(file, stbuf) &&
+                block_cache_find_block(cache, file, index) == NULL)) {
+        block_cache_add(cache, file, path, hash, stbuf, index, generation);
+        reserved = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return reserved;
+}
+
+/*
+ * Must be called with cache->lock held. Drops the pending block of the
+ * reservation made at generation, unless an invalidation of path already
+ * did and another reader reserved the block again since.
+ */
+static void block_cache_drop_pending(struct block_cache *cache,
+                                     const char *path, uint32_t hash,
+                                     uint64_t index, uint64_t generation)
+{
+    struct block_cache_file *file = block_cache_find_file(cache, path, hash);
+    struct block_cache_block *block =
+        file == NULL ? NULL : block_cache_find_block(cache, file, index);
+    if (block != NULL && block->pending && block->generation == generation)
+        block_cache_remove(cache, block);
+}
+
+/* Gives up a reservation whose fetch failed, waking readers waiting on it. */
+void block_cache_cancel(struct block_cache *cache, const char *path,
+                        uint64_t index, uint64_t generation)
+{
+    uint32_t hash = netfs_hash(path, strlen(path));
+    pthread_mutex_lock(&cache->lock);
+    block_cache_drop_pending(cache, path, hash, index, generation);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Takes ownership of data. stbuf is the version of the file the block was
+ * read from, the block is dropped if the cache already holds another one
+ * or if the cache was invalidated since generation.
+ */
+void block_cache_insert(struct block_cache *cache, const char *path,
+                        const struct stat *stbuf, uint64_t index, char *data,
+                        size_t length, uint64_t generation)
+{
+    if (cache->capacity == 0) {
+        netfs_buf_free(data);
+        return;
+    }
+
+    uint32_t hash = netfs_hash(path, strlen(path));
+    pthread_mutex_lock(&cache->lock);
+    if (generation != cache->generation) {
+        /* An invalidation of another path leaves the reservation behind. */
+        block_cache_drop_pending(cache, path, hash, index, generation);
+        pthread_mutex_unlock(&cache->lock);
+        netfs_buf_free(data);
+        return;
+    }
+    struct block_cache_file *file = block_cache_find_file(cache, path, hash);
+    struct block_cache_block *block = NULL;
+    if (file != NULL) {
+        if (!block_cache_same_version(file, stbuf)) {
+            pthread_mutex_unlock(&cache->lock);
+            netfs_buf_free(data);
+            return;
+        }
+        block = block_cache_find_block(cache, file, index);
+    }
+    if (block != NULL && !block->pending) {
+        /* Another thread fetched it first. */
+        pthread_mutex_unlock(&cache->lock);
+        netfs_buf_free(data);
+        return;
+    }
+    if (block == NULL)
+        block = block_cache_add(cache, file, path, hash, stbuf, index,
+                                generation);
+
+    block->pending = false;
+    block->length = length;
+    block->data = data;
+    DL_APPEND(cache->lru, block);
+    cache->count++;
+    pthread_cond_broadcast(&cache->filled);
+
+    /* The new block is at the tail, so its file survives the eviction. */
+    if (cache->count > cache->capacity) {
+        block_cache_remove(cache, cache->lru);
+        cache->evictions++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Drops the blocks of path and of every file below it, all for "". */
+void block_cache_invalidate(struct block_cache *cache, const char *path)
+{
+    if (cache->capacity == 0)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+    uint32_t i;
+    for (i = 0; i <= cache->bucket_mask; i++) {
+        struct block_cache_file *file, *tmp;
+        DL_FOREACH_SAFE2(cache->file_buckets[i], file, tmp, hnext) {
+            if (!path_within(file->path, path))
+                continue;
+            /* The file goes with its last block. */
+            struct block_cache_block *block, *next;
+            DL_FOREACH_SAFE2(file->blocks, block, next, fnext) {
+                block_cache_remove(cache, block);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void readahead_complete(struct netfs_request *req)
+{
+    struct readahead_job *job = (struct readahead_job *)req->arg;
+    if (req->status == 0 && req->header.operation == READ_R) {
+        block_cache_insert(&cfg.block_cache, job->path, &job->st, job->index,
+                           req->buf, req->header.payload_length,
+                           job->generation);
+    } else {
+        netfs_buf_free(req->buf);
+        block_cache_cancel(&cfg.block_cache, job->path, job->index,
+                           job->generation);
+    }
+    free(job->path);
+    free(job);
+    free(req);
+}
+
+/*
+ * Grows the readahead window of file while it is read sequentially and
+ * shrinks it on random access, then requests the blocks the window newly
+ * covers without waiting for them. Readahead only takes free request slots.
+ */
+static void readahead_update(struct netfs_file *file, const char *path,
+                             const struct stat *stbuf, uint64_t generation,
+                             off_t offset, size_t size)
+{
+    if (cfg.readahead == 0 || size == 0 || stbuf->st_size == 0)
+        return;
+
+    pthread_mutex_lock(&file->lock);
+    if (offset == file->next_offset) {
+        file->window = file->window == 0 ? READAHEAD_MIN : file->window * 2;
+        if (file->window > cfg.readahead)
+            file->window = cfg.readahead;
+    } else {
+        file->window /= 2;
+        file->ra_next = 0;
+    }
+    file->next_offset = offset + size;
+
+    uint64_t current = (offset + size - 1) / BLOCK_SIZE;
+    uint64_t first = file->ra_next > current + 1 ? file->ra_next : current + 1;
+    uint64_t last = current + file->window;
+    uint64_t eof = (stbuf->st_size - 1) / BLOCK_SIZE;
+    if (last > eof)
+        last = eof;
+    if (first <= last)
+        file->ra_next = last + 1;
+    pthread_mutex_unlock(&file->lock);
+
+    uint8_t send_packet[READ_PACKET_SIZE];
+    uint64_t index;
+    for (index = first; index <= last; index++) {
+        int server = stripe_server(path, index * BLOCK_SIZE);
+        uint64_t handle;
+        if (cfg.servers[server].max_read < BLOCK_SIZE ||
+            file_handle(file, path, server, 0, &handle) < 0)
+            continue;
+        if (!block_cache_reserve(&cfg.block_cache, path, stbuf, index,
+                                 generation))
+            continue;
+        struct readahead_job *job = malloc(sizeof(struct readahead_job));
+        job->path = strdup(path);
+        memcpy(&job->st, stbuf, sizeof(struct stat));
+        job->index = index;
+        job->generation = generation;
+
+        struct netfs_request *req = malloc(sizeof(struct netfs_request));
+        req->server = server;
+        req->complete = readahead_complete;
+        req->arg = job;
+        req->buf = netfs_buf_alloc(BLOCK_SIZE);
+        req->buf_size = BLOCK_SIZE;
+        prep_read_packet(send_packet, handle, BLOCK_SIZE, index * BLOCK_SIZE);
+        if (send_request(req, send_packet, READ_PACKET_SIZE, false) < 0) {
+            block_cache_cancel(&cfg.block_cache, path, index, generation);
+            netfs_buf_free(req->buf);
+            free(job->path);
+            free(job);
+            free(req);
+            break;
+        }
+    }
+}
+
+static void netfs_destroy(void *private_data)
+{
+    fprintf(stderr,
+            "Attribute cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+            " evictions\n",
+            cfg.attr_cache.hits, cfg.attr_cache.misses,
+            cfg.attr_cache.evictions);
+    fprintf(stderr,
+            "Block cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+            " evictions\n",
+            cfg.block_cache.hits, cfg.block_cache.misses,
+            cfg.block_cache.evictions);
+}
+
+static void attrs_to_stat(const struct netfs_attrs *attrs,
+                          struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = ntohl(attrs->mode);
+    stbuf->st_nlink = ntohl(attrs->nlink);
+    stbuf->st_uid = ntohl(attrs->uid);
+    stbuf->st_gid = ntohl(attrs->gid);
+    stbuf->st_size = ntohl(attrs->size);
+    stbuf->st_atime = ntohl(attrs->atime);
+    stbuf->st_mtime = ntohl(attrs->mtime);
+    stbuf->st_ctime = ntohl(attrs->ctime);
+    /* Reads as large as a stripe spread over the servers. */
+    stbuf->st_blksize =
+        cfg.server_count > 1 ? STRIPE_SIZE : cfg.servers[0].io_size;
+}
+
+/* A GETATTR for netfs_getattr, the same for every server. */
+struct getattr_request {
+    const char *path;
+    struct netfs_header header;
+};
+
+static int prep_getattr(int server, struct iovec *iov, void *arg)
+{
+    struct getattr_request *getattr = (struct getattr_request *)arg;
+    uint32_t send_payload_length = strlen(getattr->path);
+    PREP_NETFS_HEADER(&getattr->header, send_payload_length, GETATTR, 0);
+    iov[0] = (struct iovec){&getattr->header, NETFS_HEADER_SIZE};
+    iov[1] = (struct iovec){(char *)getattr->path, send_payload_length};
+    return 2;
+}
+
+static int netfs_getattr(const char *path, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    if (strcmp(path, STATS_PATH) == 0) {
+        /* The size is unknown before open, reads use direct I/O. */
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        return 0;
+    }
+    if (attr_cache_lookup(&cfg.attr_cache, path, stbuf))
         return 0;
+
+    struct netfs_attrs attrs;
+    struct netfs_request req = {.server = home_server(path),
+                                .buf = &attrs,
+                                .buf_size = sizeof(attrs)};
+    struct getattr_request getattr = {.path = path};
+    uint64_t generation = attr_cache_generation(&cfg.attr_cache);
+    if (netfs_transact_hedged(&req, prep_getattr, &getattr) < 0)
+        return -ENOENT;
+
+    if (req.header.operation != GETATTR_R && req.header.operation != ERROR) {
+        fprintf(stderr, "Unknown packet in GETATTR %d\n",
+                req.header.operation);
     }
-    add_connection(con);
-    return -ENOENT;
+
+    if (req.header.operation == ERROR)
+        return -req.error;
+    if (req.header.payload_length != sizeof(attrs))
+        return -EIO;
+    attrs_to_stat(&attrs, stbuf);
+    attr_cache_insert(&cfg.attr_cache, path, stbuf, generation);
+    return 0;
 }
 
-static int netfs_read(const char *path, char *buf, size_t size, off_t offset,
-                      struct fuse_file_info *fi)
+/*
+ * Lists the directory a page at a time, handing each entry's cookie to
+ * filler so FUSE resumes from offset once its buffer fills up. The rest of
+ * the page is kept in the open directory for that next call.
+ */
+static int netfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi)
 {
-    int path_len = strlen(path);
-    uint32_t send_payload_length = sizeof(struct netfs_read_write) + path_len;
-    uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
-    PREP_NETFS_HEADER(send_packet, send_payload_length, READ);
+    size_t path_len = strlen(path);
+    uint32_t send_payload_length = sizeof(struct netfs_readdir) + path_len;
+    struct netfs_header header;
+    struct netfs_readdir readdir_inf;
+
+    if (path[path_len - 1] == '/')
+        path_len--;
+    char entry_path[path_len + 1 + UINT8_MAX + 1];
+    memcpy(entry_path, path, path_len);
+    entry_path[path_len] = '/';
+
+    /* Without READDIRPLUS entries carry no attributes. */
+    int server = home_server(path);
+    bool plus = cfg.servers[server].caps & NETFS_CAP_READDIRPLUS;
+    netfs_oper op = plus ? READDIRPLUS : READDIR;
+    size_t attrs_size = plus ? sizeof(struct netfs_attrs) : 0;
+
+    struct netfs_dir *dir = fi != NULL ? (struct netfs_dir *)fi->fh : NULL;
+    if (dir != NULL && dir->page != NULL &&
+        (dir->cookie != (uint64_t)offset || dir->plus != plus)) {
+        netfs_buf_free(dir->page);
+        dir->page = NULL;
+    }
+
+    uint64_t cookie = offset;
+    bool eof = false;
+    while (!eof) {
+        uint8_t *entries;
+        uint32_t length;
+        uint32_t i;
+        uint64_t generation;
+        if (dir != NULL && dir->page != NULL) {
+            entries = dir->page;
+            length = dir->length;
+            i = dir->position;
+            generation = dir->generation;
+            dir->page = NULL;
+        } else {
+            PREP_NETFS_HEADER(&header, send_payload_length, op, 0);
+            readdir_inf.cookie = htobe64(cookie);
+            struct iovec iov[] = {{&header, NETFS_HEADER_SIZE},
+                                  {&readdir_inf, sizeof(readdir_inf)},
+                                  {(char *)path, strlen(path)}};
+
+            struct netfs_request req = {.server = server, .buf = NULL};
+            generation = attr_cache_generation(&cfg.attr_cache);
+            if (netfs_transactv(&req, iov, 3) < 0)
+                return -ENOENT;
+
+            if (req.header.operation != op + 1 &&
+                req.header.operation != ERROR) {
+                fprintf(stderr, "Unknown packet in READDIR %d\n",
+                        req.header.operation);
+            }
+
+            if (req.header.operation == ERROR)
+                return -req.error;
+            if (req.header.payload_length == 0) {
+                netfs_buf_free(req.payload);
+                return -EIO;
+            }
+            entries = (uint8_t *)req.payload;
+            length = req.header.payload_length;
+            i = 1;
+        }
+
+        /* Entry: netfs_attrs (plus only), cookie, name length, name */
+        eof = entries[0];
+        struct stat entry_st;
+        while (i < length) {
+            size_t name_offset = i + attrs_size + sizeof(uint64_t) + 1;
+            if (name_offset > length ||
+                name_offset + entries[name_offset - 1] > length) {
+                fprintf(stderr, "Malformed READDIR entry\n");
+                netfs_buf_free(entries);
+                return -EIO;
+            }
+            bool have_attrs =
+                plus && ((struct netfs_attrs *)&entries[i])->mode != 0;
+            if (have_attrs)
+                attrs_to_stat((struct netfs_attrs *)&entries[i], &entry_st);
+            uint64_t entry_cookie =
+                be64toh(*(uint64_t *)&entries[i + attrs_size]);
+            uint8_t dname_len = entries[name_offset - 1];
+            memcpy(&entry_path[path_len + 1], &entries[name_offset],
+                   dname_len);
+            entry_path[path_len + 1 + dname_len] = '\0';
+
+            const char *name = &entry_path[path_len + 1];
+            if (have_attrs && strcmp(name, ".") != 0 &&
+                strcmp(name, "..") != 0)
+                attr_cache_insert(&cfg.attr_cache, entry_path, &entry_st,
+                                  generation);
+            if (filler(buf, name, have_attrs ? &entry_st : NULL,
+                       entry_cookie)) {
+                if (dir == NULL) {
+                    netfs_buf_free(entries);
+                    return 0;
+                }
+                /* FUSE comes back with the cookie of the last entry taken. */
+                dir->page = entries;
+                dir->length = length;
+                dir->position = i;
+                dir->cookie = cookie;
+                dir->generation = generation;
+                dir->plus = plus;
+                return 0;
+            }
+            cookie = entry_cookie;
+            i = name_offset + dname_len;
+        }
+        netfs_buf_free(entries);
+    }
+    return 0;
+}
+
+static int netfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    fi->fh = (uintptr_t)calloc(1, sizeof(struct netfs_dir));
+    return fi->fh == 0 ? -ENOMEM : 0;
+}
+
+static int netfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    struct netfs_dir *dir = (struct netfs_dir *)fi->fh;
+    netfs_buf_free(dir->page);
+    free(dir);
+    return 0;
+}
+
+static int open_remote(int server, const char *path, uint64_t *handle)
+{
+    uint32_t send_payload_length = strlen(path);
+    struct netfs_header header;
+    PREP_NETFS_HEADER(&header, send_payload_length, OPEN, 0);
+    struct iovec iov[] = {{&header, NETFS_HEADER_SIZE},
+                          {(char *)path, send_payload_length}};
+
+    struct netfs_request req = {
+        .server = server, .buf = handle, .buf_size = sizeof(uint64_t)};
+    if (netfs_transactv(&req, iov, 2) < 0)
+        return -ENOENT;
+
+    if (req.header.operation != OPEN_R && req.header.operation != ERROR) {
+        fprintf(stderr, "Unknown packet in OPEN %d\n", req.header.operation);
+    }
+
+    if (req.header.operation == ERROR)
+        return -req.error;
+    if (req.header.payload_length != sizeof(uint64_t))
+        return -EIO;
+    *handle = be64toh(*handle);
+    return 0;
+}
+
+static void prep_read_packet(uint8_t *packet, uint64_t handle, size_t size,
+                             off_t offset)
+{
+    PREP_NETFS_HEADER(packet, sizeof(struct netfs_read_write), READ, 0);
 
     struct netfs_read_write *send_payload =
-        (struct netfs_read_write *)NETFS_PAYLOAD(send_packet);
-    send_payload->path_len = htonl(path_len);
+        (struct netfs_read_write *)NETFS_PAYLOAD(packet);
+    send_payload->handle = htobe64(handle);
     send_payload->count = htobe64(size);
     send_payload->file_offset = htobe64(offset);
-    strncpy(OFFSET(send_payload, sizeof(struct netfs_read_write)), path,
-            path_len);
+}
 
-    struct netfs_connection *con = get_connection();
-    struct netfs_header recv_packet_header;
-    if (sendall(con->sock_fd, send_packet,
-                NETFS_PACKET_SIZE(send_payload_length)) < 0) {
-        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
-        remove_connection(con);
-        return -ENOENT;
+/*
+ * Returns the handle of file on server in handle, opening the file there
+ * first if it is not yet or if its handle there is stale.
+ */
+static int file_handle(struct netfs_file *file, const char *path, int server,
+                       uint64_t stale, uint64_t *handle)
+{
+    int res = 0;
+    pthread_mutex_lock(&file->lock);
+    if (file->handles[server] == stale)
+        res = open_remote(server, path, &file->handles[server]);
+    *handle = file->handles[server];
+    pthread_mutex_unlock(&file->lock);
+    return res;
+}
+
+/* A READ for read_chunk, handle is the file's on server. */
+struct read_request {
+    struct netfs_file *file;
+    const char *path;
+    int server;
+    uint64_t handle;
+    size_t size;
+    off_t offset;
+    uint8_t packet[READ_PACKET_SIZE];
+};
+
+/* A READ for another server uses the file's handle there. */
+static int prep_read(int server, struct iovec *iov, void *arg)
+{
+    struct read_request *request = (struct read_request *)arg;
+    uint64_t handle = request->handle;
+    if (server != request->server &&
+        file_handle(request->file, request->path, server, 0, &handle) < 0)
+        return -1;
+    prep_read_packet(request->packet, handle, request->size, request->offset);
+    iov[0] = (struct iovec){request->packet, READ_PACKET_SIZE};
+    return 1;
+}
+
+/*
+ * Reads straight from the server into buf, which the response payload is
+ * received into directly. A handle the server no longer knows, because the
+ * connection that opened it was lost, is replaced and the read retried.
+ * A slow read is hedged on the next server.
+ * Returns the number of bytes read or a negated errno.
+ */
+static int read_chunk(struct netfs_file *file, const char *path, char *buf,
+                      size_t size, off_t offset)
+{
+    int server = stripe_server(path, offset);
+    struct read_request request = {.file = file,
+                                .path = path,
+                                .server = server,
+                                .size = size,
+                                .offset = offset};
+    uint64_t handle;
+    int res = file_handle(file, path, server, 0, &handle);
+    if (res < 0)
+        return res;
+    int attempt;
+    for (attempt = 0; attempt < 2; attempt++) {
+        request.handle = handle;
+        struct netfs_request req = {
+            .server = server, .buf = buf, .buf_size = size};
+        if (netfs_transact_hedged(&req, prep_read, &request) < 0)
+            return -ENOENT;
+
+        if (req.header.operation != READ_R && req.header.operation != ERROR) {
+            fprintf(stderr, "Unknown packet in READ %d\n",
+                    req.header.operation);
+        }
+
+        if (req.header.operation != ERROR)
+            return req.header.payload_length;
+        if (req.error != EBADF)
+            return -req.error;
+
+        if ((res = file_handle(file, path, server, handle, &handle)) < 0)
+            return res;
     }
-    if (recvall(con->sock_fd, &recv_packet_header, NETFS_HEADER_SIZE) < 0) {
-        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
-        remove_connection(con);
-        return -ENOENT;
+    return -EBADF;
+}
+
+/* Splits the read into stripes and pieces the servers accept. */
+static int read_remote(struct netfs_file *file, const char *path, char *buf,
+                       size_t size, off_t offset)
+{
+    size_t read_bytes = 0;
+    while (read_bytes < size) {
+        off_t chunk_offset = offset + read_bytes;
+        size_t chunk = size - read_bytes;
+        size_t max_read =
+            cfg.servers[stripe_server(path, chunk_offset)].max_read;
+        if (chunk > max_read)
+            chunk = max_read;
+        if (cfg.server_count > 1 &&
+            chunk > STRIPE_SIZE - chunk_offset % STRIPE_SIZE)
+            chunk = STRIPE_SIZE - chunk_offset % STRIPE_SIZE;
+        int res =
+            read_chunk(file, path, buf + read_bytes, chunk, chunk_offset);
+        if (res < 0)
+            return read_bytes > 0 ? read_bytes : res;
+        read_bytes += res;
+        if (res < chunk)
+            break; /* End of file */
     }
+    return read_bytes;
+}
+
+/* Request statistics followed by the cache and hedging counters. */
+static size_t format_stats(char *buf, size_t size)
+{
+    size_t length = netfs_stats_format(&cfg.stats, buf, size);
+    pthread_mutex_lock(&cfg.attr_cache.lock);
+    length += snprintf(buf + length, size - length,
+                       "attr_cache %" PRIu64 " hits %" PRIu64
+                       " misses %" PRIu64 " evictions\n",
+                       cfg.attr_cache.hits, cfg.attr_cache.misses,
+                       cfg.attr_cache.evictions);
+    pthread_mutex_unlock(&cfg.attr_cache.lock);
+    if (length >= size)
+        return size - 1;
+    pthread_mutex_lock(&cfg.block_cache.lock);
+    length += snprintf(buf + length, size - length,
+                       "block_cache %" PRIu64 " hits %" PRIu64
+                       " misses %" PRIu64 " evictions\n",
+                       cfg.block_cache.hits, cfg.block_cache.misses,
+                       cfg.block_cache.evictions);
+    pthread_mutex_unlock(&cfg.block_cache.lock);
+    if (length >= size)
+        return size - 1;
+    pthread_mutex_lock(&cfg.connections_lock);
+    length += snprintf(buf + length, size - length, "hedges %" PRIu64 "\n",
+                       cfg.hedges);
+    pthread_mutex_unlock(&cfg.connections_lock);
+    return length < size ? length : size - 1;
+}
 
-    if (recv_packet_header.operation != READ_R &&
-        recv_packet_header.operation != ERROR) {
-        fprintf(stderr, "Unknown packet in READ %d\n",
-                recv_packet_header.operation);
+/* Snapshots the statistics, so reads at any offset see the same text. */
+static int open_stats(struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+    struct stats_snapshot *snapshot = malloc(sizeof(struct stats_snapshot));
+    if (snapshot == NULL)
+        return -ENOMEM;
+    snapshot->length = format_stats(snapshot->text, NETFS_STATS_TEXT_MAX);
+    fi->fh = (uintptr_t)snapshot;
+    fi->direct_io = 1;
+    return 0;
+}
+
+/* Opens on the home server, the others are opened when first read from. */
+static int netfs_open(const char *path, struct fuse_file_info *fi)
+{
+    if (strcmp(path, STATS_PATH) == 0)
+        return open_stats(fi);
+
+    uint64_t handle;
+    int server = home_server(path);
+    int res = open_remote(server, path, &handle);
+    if (res < 0)
+        return res;
+
+    struct netfs_file *file = calloc(1, sizeof(struct netfs_file));
+    pthread_mutex_init(&file->lock, NULL);
+    file->handles[server] = handle;
+    fi->fh = (uintptr_t)file;
+    return 0;
+}
+
+static void release_complete(struct netfs_request *req)
+{
+    netfs_buf_free(req->payload);
+    free(req);
+}
+
+static int netfs_release(const char *path, struct fuse_file_info *fi)
+{
+    if (strcmp(path, STATS_PATH) == 0) {
+        free((struct stats_snapshot *)fi->fh);
+        return 0;
     }
 
-    recv_packet_header.payload_length =
-        ntohl(recv_packet_header.payload_length);
-    void *recv_packet_payload = malloc(recv_packet_header.payload_length);
-    if (recvall(con->sock_fd, recv_packet_payload,
-                recv_packet_header.payload_length) < 0) {
-        fprintf(stderr, "Connection Lost %s\n", strerror(errno));
-        free(recv_packet_payload);
-        remove_connection(con);
-        return -ENOENT;
+    struct netfs_file *file = (struct netfs_file *)fi->fh;
+
+    /* Nobody waits for the answers, servers drop handles they lost. */
+    uint32_t send_payload_length = sizeof(uint64_t);
+    uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
+    int server;
+    for (server = 0; server < cfg.server_count; server++) {
+        if (file->handles[server] == 0)
+            continue;
+        PREP_NETFS_HEADER(send_packet, send_payload_length, RELEASE, 0);
+        *(uint64_t *)NETFS_PAYLOAD(send_packet) =
+            htobe64(file->handles[server]);
+        struct netfs_request *req = malloc(sizeof(struct netfs_request));
+        req->server = server;
+        req->complete = release_complete;
+        req->buf = NULL;
+        if (send_request(req, send_packet,
+                         NETFS_PACKET_SIZE(send_payload_length), true) < 0)
+            free(req);
     }
 
-    if (recv_packet_header.operation == ERROR) {
-        errno = ntohl(*(uint32_t *)recv_packet_payload);
-        free(recv_packet_payload);
-        add_connection(con);
-        return -errno;
-    } else {
-        int read_bytes = recv_packet_header.payload_length;
-        memcpy(buf, recv_packet_payload, recv_packet_header.payload_length);
-        free(recv_packet_payload);
-        add_connection(con);
-        return read_bytes;
+    pthread_mutex_destroy(&file->lock);
+    free(file);
+    return 0;
+}
+
+static int netfs_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
+{
+    if (strcmp(path, STATS_PATH) == 0) {
+        struct stats_snapshot *snapshot = (struct stats_snapshot *)fi->fh;
+        if (offset >= (off_t)snapshot->length)
+            return 0;
+        if (size > snapshot->length - offset)
+            size = snapshot->length - offset;
+        memcpy(buf, snapshot->text + offset, size);
+        return size;
     }
 
-    add_connection(con);
-    return -ENOENT;
+    struct netfs_file *file = (struct netfs_file *)fi->fh;
+    if (cfg.block_cache.capacity == 0)
+        return read_remote(file, path, buf, size, offset);
+
+    /* Before the attributes, blocks of an invalidated version are dropped. */
+    uint64_t generation = block_cache_generation(&cfg.block_cache);
+    struct stat stbuf;
+    int res = netfs_getattr(path, &stbuf);
+    if (res < 0)
+        return res;
+    block_cache_validate(&cfg.block_cache, path, &stbuf);
+    readahead_update(file, path, &stbuf, generation, offset, size);
+
+    size_t read_bytes = 0;
+    while (read_bytes < size) {
+        uint64_t index = (offset + read_bytes) / BLOCK_SIZE;
+        size_t block_offset = (offset + read_bytes) % BLOCK_SIZE;
+        ssize_t copied =
+            block_cache_read(&cfg.block_cache, path, index, buf + read_bytes,
+                             block_offset, size - read_bytes);
+        if (copied < 0) {
+            char *data = netfs_buf_alloc(BLOCK_SIZE);
+            res = read_remote(file, path, data, BLOCK_SIZE,
+                              index * BLOCK_SIZE);
+            if (res < 0) {
+                netfs_buf_free(data);
+                return read_bytes > 0 ? read_bytes : res;
+            }
+            copied = 0;
+            if (block_offset < res) {
+                copied = res - block_offset < size - read_bytes
+                             ? res - block_offset
+                             : size - read_bytes;
+                memcpy(buf + read_bytes, data + block_offset, copied);
+            }
+            block_cache_insert(&cfg.block_cache, path, &stbuf, index, data,
+                               res, generation);
+        }
+        read_bytes += copied;
+        if (block_offset + copied < BLOCK_SIZE)
+            break; /* End of file */
+    }
+    return read_bytes;
 }
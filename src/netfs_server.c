@@ -1,255 +1,2783 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "protocol.h"
+#include "utlist.h"
 
-#define SERVER_ARGUMENT_COUNT 3
+#define SERVER_ARGUMENT_COUNT 2
+#define MAX_REQUEST_SIZE 8192
+#define INPUT_BUFFER_SIZE (2 * NETFS_PACKET_SIZE(MAX_REQUEST_SIZE))
+#define MAX_EVENTS 64
+#define HANDLE_BUCKETS 1024
+#define FD_CACHE_SIZE 512
+#define FD_CACHE_SHARDS 16
+#define FD_CACHE_BUCKETS 256
+#define URING_ENTRIES 256
+#define READDIR_PAGE_SIZE (64 * 1024) /* Whole READDIR_R packet */
+#define MAX_READ_SIZE (NETFS_MAX_BUFFER - NETFS_HEADER_SIZE)
+#define PREFERRED_IO_SIZE (256 * 1024) /* Advertised in HELLO_R */
+#define OUTPUT_IOV_MAX 64 /* Queued buffers gathered into one sendmsg */
+/* Reads this close to where a stream left off still continue it */
+#define STREAM_SLACK (4 * 1024 * 1024)
+#define PREFETCH_TRIGGER (1024 * 1024)
+#define PREFETCH_WINDOW (16 * 1024 * 1024)
+/* Streams this long are taken for one-pass scans */
+#define DROP_BEHIND_TRIGGER (64 * 1024 * 1024)
+#define DROP_BEHIND_LAG (8 * 1024 * 1024)
+#define DROP_BEHIND_CHUNK (4 * 1024 * 1024)
+#define DIR_CACHE_SIZE 256
+#define DIR_CACHE_BUCKETS 256
+#define STAT_CACHE_SIZE 65536
+#define STAT_CACHE_SHARDS 16
+#define STAT_CACHE_BUCKETS 4096
+#define WATCH_BUCKETS 1024
+#define LEASE_BUCKETS 16384
+#define MAX_LEASES 65536 /* Per connection, the oldest is revoked beyond */
+#define WATCH_EVENTS                                                           \
+    (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM |          \
+     IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
 
-struct client_handler_args {
-    int client_socket_fd;
+/* An O_PATH descriptor of a directory below stor_dir, lookups start here. */
+struct dir_fd {
+    char *path;
+    int fd;
+    int refs; /* The cache and lookups using fd */
+
+    /* Hash bucket chain */
+    struct dir_fd *hnext;
+    struct dir_fd *hprev;
+    /* LRU list, most recently used first */
+    struct dir_fd *next;
+    struct dir_fd *prev;
+};
+
+/* A stat result, or a missing path, for a path relative to stor_dir. */
+struct stat_entry {
+    char *path;
+    struct stat st;
+    int error; /* 0 or ENOENT */
+
+    /* Hash bucket chain */
+    struct stat_entry *hnext;
+    struct stat_entry *hprev;
+    /* LRU list, most recently used first */
+    struct stat_entry *next;
+    struct stat_entry *prev;
+};
+
+struct stat_cache_shard {
+    pthread_mutex_t lock;
+    struct stat_entry *buckets[STAT_CACHE_BUCKETS];
+    struct stat_entry *lru;
+    int size;
+    /* Bumped by invalidations, results stat'ed across one are dropped */
+    uint64_t generation;
+};
+
+/*
+ * An inotify watch on a directory holding cached entries, or on a cached
+ * directory itself, so that changes to any cached path are reported.
+ */
+struct dir_watch {
+    char *path;
+    int wd;
+
+    /* Chains of watches_by_path and watches_by_wd */
+    struct dir_watch *pnext;
+    struct dir_watch *pprev;
+    struct dir_watch *wnext;
+    struct dir_watch *wprev;
+};
+
+/*
+ * A promise to send the connection INVALIDATE once path, or an entry of
+ * it for a directory, changes. Granted before path is looked at for the
+ * response and revoked by that message.
+ */
+struct lease {
+    char *path;
+    uint32_t hash;
+    struct client_connection *con;
+
+    /* Chain of leases */
+    struct lease *hnext;
+    struct lease *hprev;
+    /* Leases of con, oldest first */
+    struct lease *next;
+    struct lease *prev;
+};
+
+/* A read-only descriptor shared by every handle opened on the same path. */
+struct cached_fd {
+    char *path;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    bool regular; /* sendfile can serve it */
+    int refs; /* The cache and open files using fd */
+    struct fd_cache_shard *shard;
+
+    /* Hash bucket chain */
+    struct cached_fd *hnext;
+    struct cached_fd *hprev;
+    /* LRU list, most recently used first */
+    struct cached_fd *next;
+    struct cached_fd *prev;
+};
+
+/* Shards keep opens of unrelated paths from contending on one lock. */
+struct fd_cache_shard {
+    pthread_mutex_t lock;
+    struct cached_fd *buckets[FD_CACHE_BUCKETS];
+    struct cached_fd *lru;
+    int size;
+};
+
+/* A file opened by OPEN, looked up by handle. */
+struct open_file {
+    uint64_t handle;
+    struct cached_fd *cached;
+    int fd; /* cached->fd */
+    int refs; /* The table and requests using fd */
+    struct client_connection *owner;
+
+    /* Read stream of this handle, protected by stream_lock */
+    pthread_mutex_t stream_lock;
+    uint64_t stream_next;   /* End of the furthest read */
+    uint64_t stream_length; /* Bytes read sequentially so far */
+    uint64_t prefetched;    /* Advised WILLNEED up to here */
+    uint64_t dropped;       /* Advised DONTNEED up to here */
+
+    /* Hash bucket chain */
+    struct open_file *hnext;
+    struct open_file *hprev;
+    /* Files opened over the same connection */
+    struct open_file *next;
+    struct open_file *prev;
+};
+
+/*
+ * Response bytes the socket did not take yet. They come either from data or,
+ * when file is set, straight from the file at file_offset via sendfile.
+ */
+struct output_buffer {
+    uint8_t *data;
+    struct open_file *file; /* Reference held until sent */
+    off_t file_offset;
+    size_t size;
+    size_t offset;
+
+    struct output_buffer *next;
+    struct output_buffer *prev;
+};
+
+/* Each event loop thread polls its own share of the connections. */
+struct event_loop {
+    int epoll_fd;
+    unsigned int next_worker; /* Where the loop queues its next request */
+};
+
+struct client_connection {
+    int socket_fd;
+    struct netfs_shm *shm; /* Carries the data instead of socket_fd */
+    struct event_loop *loop;
+    pthread_mutex_t lock;
+    int refs; /* Event loop and requests being handled */
+    struct open_file *files; /* Closed along with the connection */
+    uint32_t max_read; /* Lowered by the client's HELLO */
+    uint32_t caps;     /* NETFS_CAP_ bits of the client's HELLO */
+    uint64_t session;  /* From the client's HELLO, 0 if none */
+
+    /* Protected by leases_lock */
+    struct lease *leases;
+    int lease_count;
+
+    /* Received bytes not yet parsed into requests, owned by the loop */
+    uint8_t *input;
+    size_t input_length;
+
+    /* Protected by send_lock */
+    pthread_mutex_t send_lock;
+    struct output_buffer *output;
+    bool want_write; /* EPOLLOUT is enabled */
+    bool closed;
+};
+
+/* A fully received request, handled by a pool worker. */
+struct netfs_request {
+    struct client_connection *con;
+    struct netfs_header header; /* Host byte order */
+    uint8_t *payload;           /* NUL terminated */
+    uint64_t received_us;
+    bool failed; /* An ERROR was sent */
+
+    struct netfs_request *next;
+    struct netfs_request *prev;
+};
+
+/*
+ * Workers pop their own queue from the head and steal from the tail of
+ * the others, so a burst landing on one queue still spreads over the pool.
+ * A worker with nothing to take sleeps on its own cond.
+ */
+struct worker {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct netfs_request *queue;
+    bool idle; /* Waiting on cond, cleared by whoever wakes it */
+};
+
+/* A request operation in flight on the ring. */
+struct uring_op {
+    struct netfs_request *req;
+    /* Finishes req, or hands it on, and frees op */
+    void (*complete)(struct uring_op *op, int res);
+    struct dir_fd *dir;
+    const char *name; /* Last component of the GETATTR path */
+    char *dir_path;   /* Parent being opened, while dir is NULL */
+    struct open_how how;
+    struct statx stx;
+    struct open_file *file;
+    uint8_t *packet;
+    bool cacheable; /* The result may go into the stat cache */
+    uint64_t generation;
+};
+
+/*
+ * Storage io_uring. Event loops fill SQEs for every request parsed from a
+ * read and submit them in one batch, the ring thread reaps completions.
+ */
+struct uring {
+    int fd;
+    pthread_mutex_t lock; /* Submission side */
+    unsigned to_submit;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
 };
 
-void *client_handler(void *arg);
+void *event_loop(void *arg);
+void *worker_thread(void *arg);
+void *uring_thread(void *arg);
+void *inotify_thread(void *arg);
+void *stats_thread(void *arg);
+static void watches_init(void);
+static bool watch_dir(const char *dir);
+static struct dir_fd *resolve_parent(const char *path, const char **name,
+                                     bool may_open);
+static void put_dir_fd(struct dir_fd *dir);
+static int stat_beneath(const char *path, struct stat *st);
+static bool stat_cache_lookup(const char *path, struct stat *st, int *error,
+                              uint64_t *generation);
+static bool watch_path(const char *path);
+static bool parent_watched(const char *path);
+static bool dir_watched(const char *dir);
+static bool stat_cache_watch(const char *path);
+static bool renew_lease(struct client_connection *con, const char *path);
+static void grant_lease(struct client_connection *con, const char *path);
+static void revoke_leases(const char *path);
+static void revoke_all_leases(void);
+static void drop_leases(struct client_connection *con);
+static void stat_cache_insert(const char *path, const struct stat *st,
+                              int error, uint64_t generation);
+static int cached_stat(const char *path, struct stat *st);
+static int uring_init(void);
+static bool uring_dispatch(struct netfs_request *req);
+static void uring_submit(void);
+static void uring_close(int fd);
+static void uring_fadvise(int fd, uint64_t offset, uint64_t length,
+                          int advice);
+static void track_stream(struct open_file *file, uint64_t offset,
+                         uint64_t count);
+static void queue_request(struct netfs_request *req);
+static void handle_request(struct netfs_request *req);
+static void finish_request(struct netfs_request *req);
+static void put_connection(struct client_connection *con);
+static void put_open_file(struct open_file *file);
+static struct open_file *get_open_file(struct client_connection *con,
+                                       uint64_t handle);
+static int send_packet(struct client_connection *con, void *packet,
+                       size_t size);
+static int send_response(struct netfs_request *req, void *packet,
+                         size_t size);
+static int send_file_response(struct netfs_request *req,
+                              struct open_file *file, off_t offset,
+                              size_t count);
+static int send_error(struct netfs_request *req, int err);
+static void send_attrs(struct netfs_request *req, const struct stat *st);
+static void fill_attrs(struct netfs_attrs *attrs, const struct stat *st);
+
+/*
+ * Handles are never reused, so a request carrying a stale handle fails
+ * instead of reaching a file opened later.
+ */
+struct open_file *open_files[HANDLE_BUCKETS];
+uint64_t next_handle = 1;
+pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int server_sock_fd;
+int transport; /* NETFS_TRANSPORT_ of the listening address */
 char *stor_dir;
+int root_fd; /* O_PATH descriptor of stor_dir */
+struct event_loop *loops;
+int loop_count;
 
-void init(char *storage_dir, uint16_t port)
-{
-    stor_dir = storage_dir;
+bool zero_copy = true;
+bool prefetch = true;
+bool use_uring = false;
+struct uring ring;
+
+/* Kernels without openat2 fall back to rejecting any ".." */
+bool have_openat2 = true;
+struct dir_fd root_dir;
+struct dir_fd *dir_cache[DIR_CACHE_BUCKETS];
+struct dir_fd *dir_lru;
+int dir_cache_count;
+int dir_cache_size = DIR_CACHE_SIZE; /* Directories kept open, 0 disables */
+uint64_t dir_cache_generation; /* Bumped by every flush */
+pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct stat_cache_shard stat_cache[STAT_CACHE_SHARDS];
+int stat_cache_size = STAT_CACHE_SIZE; /* Entries kept, 0 disables */
+int inotify_fd;
+struct dir_watch *watches_by_path[WATCH_BUCKETS];
+struct dir_watch *watches_by_wd[WATCH_BUCKETS];
+pthread_mutex_t watches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool grant_leases = true;
+struct lease *leases[LEASE_BUCKETS];
+uint64_t leases_generation; /* Bumped by every flush */
+pthread_mutex_t leases_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct fd_cache_shard fd_cache[FD_CACHE_SHARDS];
+int fd_cache_size = FD_CACHE_SIZE; /* Descriptors kept open, 0 disables */
+
+struct worker *workers;
+int worker_count;
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(struct sockaddr_in));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+struct netfs_stats stats; /* Written to stderr on SIGUSR1 */
 
-    if ((server_sock_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+/* Binds server_sock_fd to "unix:PATH", "shm:PATH" or a TCP port. */
+static void listen_on(char *address)
+{
+    const char *path;
+    struct sockaddr_storage addr;
+    socklen_t addr_size;
+    memset(&addr, 0, sizeof(struct sockaddr_storage));
+    transport = netfs_parse_address(address, &path);
+    if (transport == NETFS_TRANSPORT_TCP) {
+        struct sockaddr_in *in_addr = (struct sockaddr_in *)&addr;
+        in_addr->sin_family = AF_INET;
+        in_addr->sin_port = htons(atoi(address));
+        in_addr->sin_addr.s_addr = htonl(INADDR_ANY);
+        addr_size = sizeof(struct sockaddr_in);
+    } else {
+        struct sockaddr_un *un_addr = (struct sockaddr_un *)&addr;
+        if (strlen(path) >= sizeof(un_addr->sun_path)) {
+            fprintf(stderr, "Socket path too long: %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        un_addr->sun_family = AF_UNIX;
+        strcpy(un_addr->sun_path, path);
+        addr_size = sizeof(struct sockaddr_un);
+        unlink(path); /* Left behind by an earlier run */
+    }
+
+    if ((server_sock_fd = socket(addr.ss_family, SOCK_STREAM, 0)) == -1) {
         fprintf(stderr, "Socket creation failed! Error: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    if (bind(server_sock_fd, (struct sockaddr *)&addr,
-             sizeof(struct sockaddr_in)) == -1) {
+    if (bind(server_sock_fd, (struct sockaddr *)&addr, addr_size) == -1) {
         fprintf(stderr, "Server socket binding failed, Error: %s\n",
                 strerror(errno));
         exit(EXIT_FAILURE);
     }
-    if (listen(server_sock_fd, 1)) {
+    if (listen(server_sock_fd, SOMAXCONN)) {
         fprintf(stderr, "Server socket listen failed, Error: %s\n",
                 strerror(errno));
         exit(EXIT_FAILURE);
     }
 }
 
+void init(char *storage_dir, char *address)
+{
+    stor_dir = storage_dir;
+    if ((root_fd = open(stor_dir, O_PATH | O_DIRECTORY)) < 0) {
+        fprintf(stderr, "Opening storage directory failed, Error: %s\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    root_dir.fd = root_fd;
+
+    /* Send failures are handled where they happen. */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Blocked before any thread starts, so only stats_thread takes it. */
+    sigset_t dump_signals;
+    sigemptyset(&dump_signals);
+    sigaddset(&dump_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &dump_signals, NULL);
+    pthread_t stats_t;
+    pthread_create(&stats_t, NULL, stats_thread, NULL);
+    pthread_detach(stats_t);
+
+    int i;
+    for (i = 0; i < FD_CACHE_SHARDS; i++)
+        pthread_mutex_init(&fd_cache[i].lock, NULL);
+
+    watches_init();
+
+    if (use_uring && uring_init() < 0) {
+        fprintf(stderr, "io_uring unavailable, using blocking I/O: %s\n",
+                strerror(errno));
+        use_uring = false;
+    }
+
+    listen_on(address);
+
+    workers = calloc(worker_count, sizeof(struct worker));
+    for (i = 0; i < worker_count; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        pthread_cond_init(&workers[i].cond, NULL);
+        pthread_t t;
+        pthread_create(&t, NULL, worker_thread, (void *)&workers[i]);
+        pthread_detach(t);
+    }
+
+    loops = calloc(loop_count, sizeof(struct event_loop));
+    for (i = 0; i < loop_count; i++) {
+        if ((loops[i].epoll_fd = epoll_create1(0)) == -1) {
+            fprintf(stderr, "epoll creation failed, Error: %s\n",
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        loops[i].next_worker = i;
+        pthread_t t;
+        pthread_create(&t, NULL, event_loop, (void *)&loops[i]);
+        pthread_detach(t);
+    }
+}
+
+static void usage(char *name)
+{
+    fprintf(stdout,
+            "%s: Usage: %s [-t event loop threads] [-w worker threads] "
+            "[-b (buffered reads)] [-f cached descriptors] "
+            "[-s cached stat results] [-d cached directories] "
+            "[-u (io_uring)] [-p (no prefetch)] [-l (no leases)] "
+            "[storage directory] [port, unix:PATH or shm:PATH]\n"
+            "Statistics are written to stderr on SIGUSR1.\n",
+            name, name);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != SERVER_ARGUMENT_COUNT) {
-        fprintf(stdout, "%s: Usage: %s [storage directory] [port]\n", argv[0],
-                argv[0]);
+    loop_count = sysconf(_SC_NPROCESSORS_ONLN);
+    /* Extra workers cover those blocked on disk. */
+    worker_count = 2 * loop_count;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:w:bf:s:d:upl")) != -1) {
+        switch (opt) {
+        case 'b':
+            zero_copy = false;
+            break;
+        case 'f':
+            fd_cache_size = atoi(optarg);
+            break;
+        case 's':
+            stat_cache_size = atoi(optarg);
+            break;
+        case 'd':
+            dir_cache_size = atoi(optarg);
+            break;
+        case 'u':
+            use_uring = true;
+            break;
+        case 'p':
+            prefetch = false;
+            break;
+        case 'l':
+            grant_leases = false;
+            break;
+        case 't':
+            loop_count = atoi(optarg);
+            break;
+        case 'w':
+            worker_count = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != SERVER_ARGUMENT_COUNT || loop_count < 1 ||
+        worker_count < 1 || fd_cache_size < 0 || stat_cache_size < 0 ||
+        dir_cache_size < 0) {
+        usage(argv[0]);
         return EXIT_FAILURE;
     }
-    init(argv[1], atoi(argv[2]));
+    init(argv[optind], argv[optind + 1]);
 
     int client_sock_fd;
-    struct client_handler_args *c_args;
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_size = sizeof(struct sockaddr_in);
+    int next_loop = 0;
+    struct client_connection *con;
     while (true) {
         /* Wait for connection. */
-        if ((client_sock_fd =
-                 accept(server_sock_fd, (struct sockaddr *)&client_addr,
-                        &client_addr_size)) == -1) {
+        if ((client_sock_fd = accept(server_sock_fd, NULL, NULL)) == -1) {
             fprintf(stderr, "Accepting client connection failed, Error: %s\n",
                     strerror(errno));
             continue;
         }
-        c_args = malloc(sizeof(struct client_handler_args));
-        c_args->client_socket_fd = client_sock_fd;
-        pthread_t t;
-        pthread_create(&t, NULL, client_handler, (void *)c_args);
+        struct netfs_shm *shm = NULL;
+        if (transport == NETFS_TRANSPORT_SHM &&
+            (shm = netfs_shm_create(client_sock_fd)) == NULL) {
+            fprintf(stderr, "Shared memory setup failed, Error: %s\n",
+                    strerror(errno));
+            close(client_sock_fd);
+            continue;
+        }
+        fcntl(client_sock_fd, F_SETFL,
+              fcntl(client_sock_fd, F_GETFL) | O_NONBLOCK);
+
+        con = calloc(1, sizeof(struct client_connection));
+        con->socket_fd = client_sock_fd;
+        con->shm = shm;
+        con->loop = &loops[next_loop++ % loop_count];
+        pthread_mutex_init(&con->lock, NULL);
+        pthread_mutex_init(&con->send_lock, NULL);
+        con->refs = 1;
+        con->max_read = MAX_READ_SIZE;
+        con->input = malloc(INPUT_BUFFER_SIZE);
+
+        /* With rings the socket only reports hangups, the eventfds the rest */
+        struct epoll_event event;
+        event.events = shm != NULL ? EPOLLRDHUP : EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = con;
+        int res = epoll_ctl(con->loop->epoll_fd, EPOLL_CTL_ADD, client_sock_fd,
+                            &event);
+        if (res == 0 && shm != NULL) {
+            event.events = EPOLLIN;
+            res = epoll_ctl(con->loop->epoll_fd, EPOLL_CTL_ADD, shm->data_fd,
+                            &event);
+            if (res == 0)
+                res = epoll_ctl(con->loop->epoll_fd, EPOLL_CTL_ADD,
+                                shm->room_fd, &event);
+        }
+        if (res == -1) {
+            fprintf(stderr, "Registering client connection failed, Error: %s\n",
+                    strerror(errno));
+            put_connection(con);
+        }
     }
 
     return 0;
 }
 
-void *client_handler(void *arg)
+/* Queues a request on the pool, responses go out in completion order. */
+static void dispatch_request(struct netfs_request *req)
+{
+    pthread_mutex_lock(&req->con->lock);
+    req->con->refs++;
+    pthread_mutex_unlock(&req->con->lock);
+
+    if (use_uring && uring_dispatch(req))
+        return;
+    queue_request(req);
+}
+
+/* Must be called with w->lock held, returns false if w was not idle. */
+static bool wake_worker(struct worker *w)
+{
+    if (!__atomic_load_n(&w->idle, __ATOMIC_RELAXED))
+        return false;
+    __atomic_store_n(&w->idle, false, __ATOMIC_RELAXED);
+    pthread_cond_signal(&w->cond);
+    return true;
+}
+
+/*
+ * Hands a request holding a connection reference to the worker pool. Each
+ * loop takes turns over the workers on its own, and wakes an idle one to
+ * steal when the worker it picked is busy.
+ */
+static void queue_request(struct netfs_request *req)
+{
+    unsigned int next =
+        __atomic_fetch_add(&req->con->loop->next_worker, 1, __ATOMIC_RELAXED);
+    struct worker *w = &workers[next % worker_count];
+    pthread_mutex_lock(&w->lock);
+    DL_APPEND(w->queue, req);
+    bool woken = wake_worker(w);
+    pthread_mutex_unlock(&w->lock);
+
+    int i;
+    for (i = 1; !woken && i < worker_count; i++) {
+        struct worker *idle = &workers[(next + i) % worker_count];
+        if (!__atomic_load_n(&idle->idle, __ATOMIC_RELAXED))
+            continue;
+        pthread_mutex_lock(&idle->lock);
+        woken = wake_worker(idle);
+        pthread_mutex_unlock(&idle->lock);
+    }
+}
+
+/* Takes the oldest request of w, or the newest one queued on another worker. */
+static struct netfs_request *take_request(struct worker *w)
 {
-    int client_socket_fd =
-        ((struct client_handler_args *)arg)->client_socket_fd;
+    struct netfs_request *req = NULL;
+    int i = w - workers;
+    int scanned;
+    for (scanned = 0; req == NULL && scanned < worker_count; scanned++) {
+        struct worker *victim = &workers[(i + scanned) % worker_count];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->queue != NULL) {
+            req = victim == w ? victim->queue : victim->queue->prev;
+            DL_DELETE(victim->queue, req);
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return req;
+}
 
-    struct netfs_header recv_packet_header;
+void *worker_thread(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
     while (true) {
-        if (recvall(client_socket_fd, &recv_packet_header, NETFS_HEADER_SIZE) <
-            0) {
-            fprintf(stdout, "Connection Lost\n");
-            break;
+        struct netfs_request *req = take_request(w);
+        if (req == NULL) {
+            /*
+             * Pushes to w are seen under its lock. A request queued on a
+             * busy worker meanwhile waits for that one or a later wake up.
+             */
+            pthread_mutex_lock(&w->lock);
+            if (w->queue == NULL) {
+                __atomic_store_n(&w->idle, true, __ATOMIC_RELAXED);
+                while (__atomic_load_n(&w->idle, __ATOMIC_RELAXED))
+                    pthread_cond_wait(&w->cond, &w->lock);
+            }
+            pthread_mutex_unlock(&w->lock);
+            continue;
         }
-        recv_packet_header.payload_length =
-            ntohl(recv_packet_header.payload_length);
+        netfs_stats_add(&stats.waits, 1);
+        netfs_stats_add(&stats.wait_us,
+                        netfs_monotonic_us() - req->received_us);
+        handle_request(req);
+    }
+    return NULL;
+}
 
-        uint32_t send_payload_length;
-        switch (recv_packet_header.operation) {
-        case GETATTR: {
-            char path[recv_packet_header.payload_length + 1];
-            path[recv_packet_header.payload_length] = '\0';
-            if (recvall(client_socket_fd, path,
-                        recv_packet_header.payload_length) < 0)
-                break;
+/* Writes the request statistics to stderr every time SIGUSR1 arrives. */
+void *stats_thread(void *arg)
+{
+    sigset_t dump_signals;
+    sigemptyset(&dump_signals);
+    sigaddset(&dump_signals, SIGUSR1);
+    char *text = malloc(NETFS_STATS_TEXT_MAX);
+    while (true) {
+        int sig;
+        if (sigwait(&dump_signals, &sig) != 0)
+            continue;
+        netfs_stats_format(&stats, text, NETFS_STATS_TEXT_MAX);
+        fputs(text, stderr);
+        fflush(stderr);
+    }
+    return NULL;
+}
 
-            char full_path[strlen(stor_dir) + strlen(path) + 1];
-            strcpy(full_path, stor_dir);
-            strcat(full_path, path);
-
-            struct stat tmp_st;
-            if (strstr(full_path, "..") !=
-                    NULL || // Don't allow to leave stor_dir
-                stat(full_path, &tmp_st) < 0) {
-                /* Send errno */
-                send_payload_length = sizeof(uint32_t);
-                uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
-                PREP_NETFS_HEADER(send_packet, send_payload_length, ERROR);
-                *(uint32_t *)NETFS_PAYLOAD(send_packet) = htonl(errno);
-                if (sendall(client_socket_fd, send_packet,
-                            NETFS_PACKET_SIZE(send_payload_length)) < 0)
-                    break;
-            } else {
-                send_payload_length = sizeof(struct netfs_attrs);
-                uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
-                PREP_NETFS_HEADER(send_packet, send_payload_length, GETATTR_R);
-
-                struct netfs_attrs *send_payload =
-                    (struct netfs_attrs *)NETFS_PAYLOAD(send_packet);
-                send_payload->mode = htonl(tmp_st.st_mode);
-                send_payload->nlink = htonl(tmp_st.st_nlink);
-                send_payload->uid = htonl(tmp_st.st_uid);
-                send_payload->gid = htonl(tmp_st.st_gid);
-                send_payload->size = htonl(tmp_st.st_size);
-                send_payload->atime = htonl(tmp_st.st_atime);
-                send_payload->mtime = htonl(tmp_st.st_mtime);
-                send_payload->ctime = htonl(tmp_st.st_ctime);
-
-                if (sendall(client_socket_fd, send_packet,
-                            NETFS_PACKET_SIZE(send_payload_length)) < 0)
-                    break;
-            }
-        } break;
-        case READDIR: {
-            char path[recv_packet_header.payload_length + 1];
-            path[recv_packet_header.payload_length] = '\0';
-            if (recvall(client_socket_fd, path,
-                        recv_packet_header.payload_length) < 0)
-                break;
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
 
-            char full_path[strlen(stor_dir) + strlen(path) + 1];
-            strcpy(full_path, stor_dir);
-            strcat(full_path, path);
-
-            int dirf;
-            struct stat dirstat;
-            DIR *dirp;
-            if (strstr(full_path, "..") != NULL ||
-                (dirp = opendir(full_path)) == NULL ||
-                (dirf = dirfd(dirp)) < 0 || fstat(dirf, &dirstat) < 0) {
-                /* Send errno */
-                send_payload_length = sizeof(uint32_t);
-                uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
-                PREP_NETFS_HEADER(send_packet, send_payload_length, ERROR);
-                *(uint32_t *)NETFS_PAYLOAD(send_packet) = htonl(errno);
-                if (sendall(client_socket_fd, send_packet,
-                            NETFS_PACKET_SIZE(send_payload_length)) < 0)
-                    break;
-            } else {
-                void *send_packet = malloc(NETFS_PACKET_SIZE(dirstat.st_size));
-                char *send_payload = (char *)NETFS_PAYLOAD(send_packet);
-
-                send_payload_length = 0;
-                struct dirent *entry;
-                while (true) {
-                    entry = readdir(dirp);
-                    if (entry == NULL)
-                        break;
-                    uint8_t str_length = strlen(entry->d_name);
-                    send_payload[send_payload_length++] = str_length;
-                    strncpy(OFFSET(send_payload, send_payload_length),
-                            entry->d_name, str_length);
-                    send_payload_length += str_length;
-                }
-                PREP_NETFS_HEADER(send_packet, send_payload_length, READDIR_R);
-                if (sendall(client_socket_fd, send_packet,
-                            NETFS_PACKET_SIZE(send_payload_length)) < 0)
-                    break;
-                free(send_packet);
-                closedir(dirp);
-            }
-        } break;
-        case READ: {
-            uint8_t recv_packet_payload[recv_packet_header.payload_length];
-            if (recvall(client_socket_fd, recv_packet_payload,
-                        recv_packet_header.payload_length) < 0)
-                break;
+/* Returns -1 with errno set when the kernel lacks io_uring or an opcode. */
+static int uring_init(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+    if ((ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0)
+        return -1;
 
-            struct netfs_read_write *inf =
-                (struct netfs_read_write *)recv_packet_payload;
-            inf->path_len = ntohl(inf->path_len);
-            inf->count = be64toh(inf->count);
-            inf->file_offset = be64toh(inf->file_offset);
-
-            char path[inf->path_len + 1];
-            path[inf->path_len] = '\0';
-            strncpy(
-                path,
-                OFFSET(recv_packet_payload, sizeof(struct netfs_read_write)),
-                inf->path_len);
-
-            char full_path[strlen(stor_dir) + strlen(path) + 1];
-            strcpy(full_path, stor_dir);
-            strcat(full_path, path);
-
-            void *send_packet = malloc(NETFS_PACKET_SIZE(inf->count));
-            int fd, read_bytes;
-            if (strstr(full_path, "..") != NULL ||
-                (fd = open(full_path, O_RDONLY)) < 0 ||
-                lseek(fd, inf->file_offset, SEEK_SET) < 0 ||
-                (read_bytes =
-                     read(fd, NETFS_PAYLOAD(send_packet), inf->count)) < 0) {
-                /* Send errno */
-                send_payload_length = sizeof(uint32_t);
-                uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
-                PREP_NETFS_HEADER(send_packet, send_payload_length, ERROR);
-                *(uint32_t *)NETFS_PAYLOAD(send_packet) = htonl(errno);
-                if (sendall(client_socket_fd, send_packet,
-                            NETFS_PACKET_SIZE(send_payload_length)) < 0)
-                    break;
-            } else {
-                send_payload_length = read_bytes;
-                PREP_NETFS_HEADER(send_packet, send_payload_length, READ_R);
-                if (sendall(client_socket_fd, send_packet,
-                            NETFS_PACKET_SIZE(send_payload_length)) < 0)
-                    break;
-            }
-            free(send_packet);
-            close(fd);
-        } break;
-        default:
-            fprintf(stderr, "Unknown packet: %u\n",
-                    recv_packet_header.operation);
-            free(arg);
-            return NULL;
+    uint8_t opcodes[] = {IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE,
+                         IORING_OP_FADVISE};
+    size_t probe_size =
+        sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe,
+                256) < 0) {
+        free(probe);
+        close(ring.fd);
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < sizeof(opcodes); i++) {
+        if (opcodes[i] > probe->last_op ||
+            !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+            free(probe);
+            close(ring.fd);
+            errno = ENOSYS;
+            return -1;
+        }
+    }
+    free(probe);
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        close(ring.fd);
+        return -1;
+    }
+    ring.sq_entries = params.sq_entries;
+    ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    pthread_mutex_init(&ring.lock, NULL);
+
+    pthread_t t;
+    pthread_create(&t, NULL, uring_thread, NULL);
+    pthread_detach(t);
+    return 0;
+}
+
+/* Must be called with ring.lock held. */
+static void uring_enter_locked(void)
+{
+    while (ring.to_submit > 0) {
+        int submitted = io_uring_enter(ring.fd, ring.to_submit, 0, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            fprintf(stderr, "io_uring submit failed, Error: %s\n",
+                    strerror(errno));
+            return;
+        }
+        ring.to_submit -= submitted;
+    }
+}
+
+/* Must be called with ring.lock held, submits first when the SQ is full. */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) ==
+        ring.sq_entries)
+        uring_enter_locked();
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring.sq_array[index] = index;
+    return sqe;
+}
+
+/* Must be called with ring.lock held, after the SQE is filled in. */
+static void uring_commit_sqe(void)
+{
+    __atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+}
+
+static void uring_submit(void)
+{
+    pthread_mutex_lock(&ring.lock);
+    uring_enter_locked();
+    pthread_mutex_unlock(&ring.lock);
+}
+
+/* Closes fd off the calling thread. */
+static void uring_close(int fd)
+{
+    pthread_mutex_lock(&ring.lock);
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = 0; /* Nothing waits on it */
+    uring_commit_sqe();
+    uring_enter_locked();
+    pthread_mutex_unlock(&ring.lock);
+}
+
+/* Queues the advice with the batch the caller submits next. */
+static void uring_fadvise(int fd, uint64_t offset, uint64_t length,
+                          int advice)
+{
+    pthread_mutex_lock(&ring.lock);
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->len = length;
+    sqe->fadvise_advice = advice;
+    sqe->user_data = 0;
+    uring_commit_sqe();
+    pthread_mutex_unlock(&ring.lock);
+}
+
+static void uring_op_done(struct uring_op *op)
+{
+    finish_request(op->req);
+    free(op);
+}
+
+/* Must be called with ring.lock held. */
+static void uring_prep_statx(struct io_uring_sqe *sqe, struct uring_op *op)
+{
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = op->dir->fd;
+    sqe->addr = (uintptr_t)op->name;
+    sqe->statx_flags =
+        AT_SYMLINK_NOFOLLOW | (op->name[0] == '\0' ? AT_EMPTY_PATH : 0);
+    sqe->len = STATX_BASIC_STATS | STATX_INO;
+    sqe->off = (uintptr_t)&op->stx;
+    sqe->user_data = (uintptr_t)op;
+}
+
+static void complete_getattr(struct uring_op *op, int res)
+{
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    put_dir_fd(op->dir);
+    if (res == 0 && S_ISLNK(op->stx.stx_mode)) {
+        /* Followed by the pool, where it stays below stor_dir */
+        queue_request(op->req);
+        free(op);
+        return;
+    }
+    if (res == 0) {
+        st.st_dev = makedev(op->stx.stx_dev_major, op->stx.stx_dev_minor);
+        st.st_ino = op->stx.stx_ino;
+        st.st_mode = op->stx.stx_mode;
+        st.st_nlink = op->stx.stx_nlink;
+        st.st_uid = op->stx.stx_uid;
+        st.st_gid = op->stx.stx_gid;
+        st.st_size = op->stx.stx_size;
+        st.st_atime = op->stx.stx_atime.tv_sec;
+        st.st_mtime = op->stx.stx_mtime.tv_sec;
+        st.st_ctime = op->stx.stx_ctime.tv_sec;
+    }
+    /* A directory also needs its own watch, see watch_path. */
+    if (op->cacheable && res == 0 && S_ISDIR(st.st_mode) &&
+        !dir_watched((char *)op->req->payload))
+        op->cacheable = false;
+    if (op->cacheable && (res == 0 || res == -ENOENT))
+        stat_cache_insert((char *)op->req->payload, &st, -res,
+                          op->generation);
+
+    if (res < 0)
+        send_error(op->req, -res);
+    else
+        send_attrs(op->req, &st);
+    uring_op_done(op);
+}
+
+/* The parent missed the dir cache, statx follows on the new descriptor. */
+static void complete_open_parent(struct uring_op *op, int res)
+{
+    if (res == -EINVAL) {
+        /* Rings without OPENAT2, the pool opens it instead */
+        free(op->dir_path);
+        queue_request(op->req);
+        free(op);
+        return;
+    }
+    if (res < 0) {
+        free(op->dir_path);
+        send_error(op->req, res == -EXDEV ? EACCES : -res);
+        uring_op_done(op);
+        return;
+    }
+    /* Left out of the cache, which only the pool fills */
+    op->dir = malloc(sizeof(struct dir_fd));
+    op->dir->path = op->dir_path;
+    op->dir->fd = res;
+    op->dir->refs = 1;
+    op->complete = complete_getattr;
+
+    pthread_mutex_lock(&ring.lock);
+    uring_prep_statx(uring_get_sqe(), op);
+    uring_commit_sqe();
+    uring_enter_locked();
+    pthread_mutex_unlock(&ring.lock);
+}
+
+static void complete_read(struct uring_op *op, int res)
+{
+    if (res < 0) {
+        send_error(op->req, -res);
+    } else {
+        PREP_NETFS_HEADER(op->packet, res, READ_R, op->req->header.tag);
+        send_response(op->req, op->packet, NETFS_PACKET_SIZE(res));
+    }
+    netfs_buf_free(op->packet);
+    put_open_file(op->file);
+    uring_op_done(op);
+}
+
+static uint64_t read_count(const struct client_connection *con,
+                           const struct netfs_read_write *inf)
+{
+    uint64_t count = be64toh(inf->count);
+    return count > con->max_read ? con->max_read : count;
+}
+
+/*
+ * Prepares GETATTR and READ as SQEs, submitted by the caller's next
+ * uring_submit. Runs on the event loop, so anything that may block, such
+ * as a new lease or watch, leaves the request to the worker pool and
+ * returns false.
+ */
+static bool uring_dispatch(struct netfs_request *req)
+{
+    struct uring_op *op;
+    struct stat st;
+    int error;
+    uint64_t generation;
+    const char *name = NULL;
+    char *path = (char *)req->payload;
+    switch (req->header.operation) {
+    case GETATTR:
+        if (!renew_lease(req->con, path))
+            return false;
+        if (stat_cache_lookup(path, &st, &error, &generation)) {
+            if (error != 0)
+                send_error(req, error);
+            else
+                send_attrs(req, &st);
+            finish_request(req);
+            return true;
+        }
+        /* The pool watches the parent on the first miss below it. */
+        if (stat_cache_size != 0 && !parent_watched(path))
+            return false;
+        struct dir_fd *dir = resolve_parent(path, &name, false);
+        /* Errors and dot names are left to the blocking path. */
+        if ((dir == NULL && (errno != EWOULDBLOCK || !have_openat2)) ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            if (dir != NULL)
+                put_dir_fd(dir);
+            return false;
+        }
+        op = calloc(1, sizeof(struct uring_op));
+        op->complete = dir != NULL ? complete_getattr : complete_open_parent;
+        op->generation = generation;
+        op->cacheable = stat_cache_size != 0;
+        op->dir = dir;
+        op->name = name;
+        if (dir == NULL) {
+            op->dir_path = strndup(path, name - 1 - path);
+            op->how.flags = O_PATH | O_DIRECTORY;
+            op->how.resolve = RESOLVE_BENEATH;
+        }
+        break;
+    case READ:
+        if (req->header.payload_length != sizeof(struct netfs_read_write))
+            return false;
+        struct netfs_read_write *inf = (struct netfs_read_write *)req->payload;
+        struct open_file *file = get_open_file(req->con, be64toh(inf->handle));
+        if (file == NULL) {
+            send_error(req, EBADF);
+            finish_request(req);
+            return true;
+        }
+        uint64_t count = read_count(req->con, inf);
+        track_stream(file, be64toh(inf->file_offset), count);
+        op = calloc(1, sizeof(struct uring_op));
+        op->complete = complete_read;
+        op->file = file;
+        op->packet = netfs_buf_alloc(NETFS_PACKET_SIZE(count));
+        break;
+    default:
+        return false;
+    }
+    op->req = req;
+
+    pthread_mutex_lock(&ring.lock);
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (req->header.operation == GETATTR && op->dir != NULL) {
+        uring_prep_statx(sqe, op);
+    } else if (req->header.operation == GETATTR) {
+        sqe->opcode = IORING_OP_OPENAT2;
+        sqe->fd = root_fd;
+        sqe->addr = (uintptr_t)(op->dir_path + 1);
+        sqe->len = sizeof(struct open_how);
+        sqe->addr2 = (uintptr_t)&op->how;
+        sqe->user_data = (uintptr_t)op;
+    } else {
+        struct netfs_read_write *inf = (struct netfs_read_write *)req->payload;
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = op->file->fd;
+        sqe->addr = (uintptr_t)NETFS_PAYLOAD(op->packet);
+        sqe->len = read_count(req->con, inf);
+        sqe->off = be64toh(inf->file_offset);
+        sqe->user_data = (uintptr_t)op;
+    }
+    uring_commit_sqe();
+    pthread_mutex_unlock(&ring.lock);
+    return true;
+}
+
+void *uring_thread(void *arg)
+{
+    while (true) {
+        unsigned head = *ring.cq_head;
+        if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS);
+            continue;
         }
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct uring_op *op = (struct uring_op *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+        if (op != NULL)
+            op->complete(op, res);
     }
-    free(arg);
     return NULL;
-}
\ No newline at end of file
+}
+
+/*
+ * Answers the request of con with tag ECANCELED if it still waits in a
+ * worker queue, the client took its response from another server.
+ * Requests already being served are left to finish.
+ */
+static void cancel_request(struct client_connection *con, uint32_t tag)
+{
+    struct netfs_request *req = NULL;
+    int i;
+    for (i = 0; req == NULL && i < worker_count; i++) {
+        struct worker *w = &workers[i];
+        struct netfs_request *queued;
+        pthread_mutex_lock(&w->lock);
+        DL_FOREACH(w->queue, queued) {
+            if (queued->con == con && queued->header.tag == tag) {
+                req = queued;
+                DL_DELETE(w->queue, req);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    if (req == NULL)
+        return;
+    send_error(req, ECANCELED);
+    finish_request(req);
+}
+
+/* Dispatches every complete request in the input buffer. */
+static int parse_requests(struct client_connection *con)
+{
+    size_t consumed = 0;
+    while (con->input_length - consumed >= NETFS_HEADER_SIZE) {
+        struct netfs_header header;
+        memcpy(&header, con->input + consumed, NETFS_HEADER_SIZE);
+        header.payload_length = ntohl(header.payload_length);
+        header.tag = ntohl(header.tag);
+        if (header.payload_length > MAX_REQUEST_SIZE) {
+            fprintf(stderr, "Request too large: %u\n", header.payload_length);
+            return -1;
+        }
+        if (con->input_length - consumed <
+            NETFS_PACKET_SIZE(header.payload_length))
+            break;
+        if (header.operation == CANCEL) {
+            /* Handled here, it must not queue behind what it cancels. */
+            cancel_request(con, header.tag);
+            consumed += NETFS_PACKET_SIZE(header.payload_length);
+            continue;
+        }
+
+        struct netfs_request *req = malloc(sizeof(struct netfs_request));
+        req->con = con;
+        req->header = header;
+        req->received_us = netfs_monotonic_us();
+        req->failed = false;
+        req->payload = netfs_buf_alloc(header.payload_length + 1);
+        memcpy(req->payload,
+               NETFS_PAYLOAD(con->input + consumed), header.payload_length);
+        req->payload[header.payload_length] = '\0';
+        consumed += NETFS_PACKET_SIZE(header.payload_length);
+        dispatch_request(req);
+    }
+    if (use_uring)
+        uring_submit();
+    con->input_length -= consumed;
+    memmove(con->input, con->input + consumed, con->input_length);
+    return 0;
+}
+
+/* Like recv on the connection's socket or ring, without blocking. */
+static ssize_t con_read(struct client_connection *con, void *buf, size_t size)
+{
+    ssize_t res = con->shm != NULL ? netfs_shm_read(con->shm, buf, size)
+                                   : recv(con->socket_fd, buf, size, 0);
+    if (res > 0)
+        netfs_stats_add(&stats.bytes_in, res);
+    return res;
+}
+
+/* Like sendmsg on the connection's socket or ring, without blocking. */
+static ssize_t con_writev(struct client_connection *con, struct iovec *iov,
+                          int iovcnt, int flags)
+{
+    ssize_t res;
+    if (con->shm != NULL) {
+        res = netfs_shm_write(con->shm, iov, iovcnt);
+    } else {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        res = sendmsg(con->socket_fd, &msg, MSG_NOSIGNAL | flags);
+    }
+    if (res > 0)
+        netfs_stats_add(&stats.bytes_out, res);
+    return res;
+}
+
+/* Returns -1 once the connection is closed or broken. */
+static int receive_requests(struct client_connection *con)
+{
+    while (true) {
+        /* A partial request always leaves room, see INPUT_BUFFER_SIZE. */
+        ssize_t recvd_bytes =
+            con_read(con, con->input + con->input_length,
+                     INPUT_BUFFER_SIZE - con->input_length);
+        if (recvd_bytes == 0)
+            return -1;
+        if (recvd_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        con->input_length += recvd_bytes;
+        if (parse_requests(con) < 0)
+            return -1;
+    }
+}
+
+/* Must be called with con->send_lock held. */
+static void watch_writable(struct client_connection *con, bool writable)
+{
+    if (con->want_write == writable)
+        return;
+    con->want_write = writable;
+    if (con->shm != NULL) {
+        netfs_shm_want_room(con->shm, writable);
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | (writable ? EPOLLOUT : 0);
+    event.data.ptr = con;
+    epoll_ctl(con->loop->epoll_fd, EPOLL_CTL_MOD, con->socket_fd, &event);
+}
+
+static void free_output_buffer(struct output_buffer *out)
+{
+    if (out->file != NULL)
+        put_open_file(out->file);
+    netfs_buf_free(out->data);
+    free(out);
+}
+
+/*
+ * Copies the unsent file range into memory for files sendfile rejects or
+ * that shrank since. The header already promised the range, so a tail cut
+ * off reads as zeros.
+ */
+static int buffer_file_range(struct output_buffer *out)
+{
+    size_t remaining = out->size - out->offset;
+    uint8_t *data = netfs_buf_alloc(remaining);
+    ssize_t read_bytes = pread(out->file->fd, data, remaining,
+                               out->file_offset + out->offset);
+    if (read_bytes < 0) {
+        netfs_buf_free(data);
+        return -1;
+    }
+    memset(data + read_bytes, 0, remaining - read_bytes);
+    put_open_file(out->file);
+    out->file = NULL;
+    out->data = data;
+    out->size = remaining;
+    out->offset = 0;
+    return 0;
+}
+
+/* Sends the queued memory buffers at the head of the output together. */
+static ssize_t send_buffers(struct client_connection *con)
+{
+    struct iovec iov[OUTPUT_IOV_MAX];
+    int iovcnt = 0;
+    struct output_buffer *out = con->output;
+    for (; out != NULL && out->file == NULL && iovcnt < OUTPUT_IOV_MAX;
+         out = out->next) {
+        iov[iovcnt].iov_base = out->data + out->offset;
+        iov[iovcnt].iov_len = out->size - out->offset;
+        iovcnt++;
+    }
+    /* Keep a header and the file data following it in one segment. */
+    return con_writev(con, iov, iovcnt, out != NULL ? MSG_MORE : 0);
+}
+
+/* Must be called with con->send_lock held. */
+static int flush_output(struct client_connection *con)
+{
+    while (con->output != NULL) {
+        struct output_buffer *out = con->output;
+        ssize_t sent_bytes;
+        if (out->file != NULL) {
+            off_t offset = out->file_offset + out->offset;
+            sent_bytes = sendfile(con->socket_fd, out->file->fd, &offset,
+                                  out->size - out->offset);
+            if (sent_bytes > 0)
+                netfs_stats_add(&stats.bytes_out, sent_bytes);
+            /* Truncated after the header went out */
+            if (sent_bytes == 0 ||
+                (sent_bytes < 0 && (errno == EINVAL || errno == ENOSYS))) {
+                if (buffer_file_range(out) < 0)
+                    return -1;
+                continue;
+            }
+        } else {
+            sent_bytes = send_buffers(con);
+        }
+        if (sent_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        /* Free what went out, a write may span several buffers. */
+        while (sent_bytes > 0) {
+            out = con->output;
+            size_t remaining = out->size - out->offset;
+            if ((size_t)sent_bytes < remaining) {
+                out->offset += sent_bytes;
+                break;
+            }
+            sent_bytes -= remaining;
+            DL_DELETE(con->output, out);
+            free_output_buffer(out);
+        }
+    }
+    watch_writable(con, con->output != NULL);
+    return 0;
+}
+
+static void close_connection(struct client_connection *con)
+{
+    epoll_ctl(con->loop->epoll_fd, EPOLL_CTL_DEL, con->socket_fd, NULL);
+    if (con->shm != NULL) {
+        epoll_ctl(con->loop->epoll_fd, EPOLL_CTL_DEL, con->shm->data_fd, NULL);
+        epoll_ctl(con->loop->epoll_fd, EPOLL_CTL_DEL, con->shm->room_fd, NULL);
+    }
+    pthread_mutex_lock(&con->send_lock);
+    con->closed = true;
+    struct output_buffer *out, *tmp;
+    DL_FOREACH_SAFE(con->output, out, tmp) {
+        DL_DELETE(con->output, out);
+        free_output_buffer(out);
+    }
+    pthread_mutex_unlock(&con->send_lock);
+    /* Make handlers still running fail fast on their sends. */
+    shutdown(con->socket_fd, SHUT_RDWR);
+    put_connection(con);
+}
+
+void *event_loop(void *arg)
+{
+    struct event_loop *loop = (struct event_loop *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        int ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno != EINTR)
+                fprintf(stderr, "epoll_wait failed, Error: %s\n",
+                        strerror(errno));
+            continue;
+        }
+        /*
+         * A ring connection has three descriptors that may all be in the
+         * batch, closing it on one event must not free it under the others.
+         */
+        int i;
+        for (i = 0; i < ready; i++) {
+            struct client_connection *con =
+                (struct client_connection *)events[i].data.ptr;
+            pthread_mutex_lock(&con->lock);
+            con->refs++;
+            pthread_mutex_unlock(&con->lock);
+        }
+        for (i = 0; i < ready; i++) {
+            struct client_connection *con =
+                (struct client_connection *)events[i].data.ptr;
+            uint32_t ready_events = events[i].events;
+            pthread_mutex_lock(&con->send_lock);
+            bool closed = con->closed;
+            pthread_mutex_unlock(&con->send_lock);
+            if (closed)
+                continue;
+            if (con->shm != NULL) {
+                /* The rings may have gained data or room either way. */
+                if (ready_events & (EPOLLRDHUP | EPOLLHUP))
+                    ready_events |= EPOLLERR;
+                netfs_shm_clear(con->shm);
+                ready_events |= EPOLLIN | EPOLLOUT;
+            }
+            bool failed = (ready_events & EPOLLERR) != 0;
+            if (!failed && (ready_events & EPOLLOUT)) {
+                pthread_mutex_lock(&con->send_lock);
+                failed = flush_output(con) < 0;
+                pthread_mutex_unlock(&con->send_lock);
+            }
+            if (!failed && (ready_events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+                failed = receive_requests(con) < 0;
+            if (failed) {
+                fprintf(stdout, "Connection Lost\n");
+                close_connection(con);
+            }
+        }
+        for (i = 0; i < ready; i++)
+            put_connection((struct client_connection *)events[i].data.ptr);
+    }
+    return NULL;
+}
+
+/*
+ * openat relative to dir_fd that fails with EXDEV instead of leaving it,
+ * whether through "..", absolute symlinks or symlinks pointing outside.
+ */
+static int openat_beneath(int dir_fd, const char *path, int flags)
+{
+    if (have_openat2) {
+        struct open_how how;
+        memset(&how, 0, sizeof(struct open_how));
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH;
+        int fd = syscall(SYS_openat2, dir_fd, path, &how,
+                         sizeof(struct open_how));
+        if (fd >= 0 || errno != ENOSYS)
+            return fd;
+        have_openat2 = false;
+    }
+    if (strstr(path, "..") != NULL) {
+        errno = EXDEV;
+        return -1;
+    }
+    return openat(dir_fd, path, flags);
+}
+
+static void free_dir_fd(struct dir_fd *dir)
+{
+    close(dir->fd);
+    free(dir->path);
+    free(dir);
+}
+
+static void put_dir_fd(struct dir_fd *dir)
+{
+    if (dir == &root_dir)
+        return;
+    pthread_mutex_lock(&dir_cache_lock);
+    int refs = --dir->refs;
+    pthread_mutex_unlock(&dir_cache_lock);
+    if (refs == 0)
+        free_dir_fd(dir);
+}
+
+/* Must be called with dir_cache_lock held, drops the cache's reference. */
+static void dir_cache_remove(struct dir_fd *dir)
+{
+    uint32_t hash = netfs_hash(dir->path, strlen(dir->path));
+    DL_DELETE2(dir_cache[hash % DIR_CACHE_BUCKETS], dir, hprev, hnext);
+    DL_DELETE(dir_lru, dir);
+    dir_cache_count--;
+    if (--dir->refs == 0)
+        free_dir_fd(dir);
+}
+
+/* Cached descriptors keep following directories that moved. */
+static void dir_cache_flush(void)
+{
+    struct dir_fd *dir, *tmp;
+    pthread_mutex_lock(&dir_cache_lock);
+    DL_FOREACH_SAFE(dir_lru, dir, tmp) {
+        dir_cache_remove(dir);
+    }
+    dir_cache_generation++;
+    pthread_mutex_unlock(&dir_cache_lock);
+}
+
+/* Watches the directories whose entries name dir or one of its parents. */
+static bool watch_ancestors(const char *dir)
+{
+    char ancestor[strlen(dir) + 1];
+    size_t i;
+    if (!watch_dir("/"))
+        return false;
+    for (i = 1; dir[i] != '\0'; i++) {
+        if (dir[i] != '/')
+            continue;
+        memcpy(ancestor, dir, i);
+        ancestor[i] = '\0';
+        if (!watch_dir(ancestor))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Returns dir, relative to stor_dir, with a reference held, or NULL. Fails
+ * with EWOULDBLOCK instead of opening an uncached dir unless may_open.
+ */
+static struct dir_fd *get_dir_fd(const char *dir, bool may_open)
+{
+    if (strcmp(dir, "/") == 0)
+        return &root_dir;
+
+    uint32_t hash = netfs_hash(dir, strlen(dir));
+    struct dir_fd **bucket = &dir_cache[hash % DIR_CACHE_BUCKETS];
+    struct dir_fd *entry;
+    pthread_mutex_lock(&dir_cache_lock);
+    DL_FOREACH2(*bucket, entry, hnext) {
+        if (strcmp(entry->path, dir) == 0)
+            break;
+    }
+    if (entry != NULL) {
+        entry->refs++;
+        DL_DELETE(dir_lru, entry);
+        DL_PREPEND(dir_lru, entry);
+        pthread_mutex_unlock(&dir_cache_lock);
+        return entry;
+    }
+    uint64_t generation = dir_cache_generation;
+    pthread_mutex_unlock(&dir_cache_lock);
+    if (!may_open) {
+        errno = EWOULDBLOCK;
+        return NULL;
+    }
+
+    bool cacheable = dir_cache_size > 0 && strstr(dir, "/..") == NULL &&
+                     watch_ancestors(dir);
+    int fd = openat_beneath(root_fd, dir + 1, O_PATH | O_DIRECTORY);
+    if (fd < 0) {
+        if (errno == EXDEV)
+            errno = EACCES;
+        return NULL;
+    }
+    entry = malloc(sizeof(struct dir_fd));
+    entry->path = strdup(dir);
+    entry->fd = fd;
+    entry->refs = 1;
+    if (!cacheable)
+        return entry;
+
+    struct dir_fd *raced;
+    pthread_mutex_lock(&dir_cache_lock);
+    DL_FOREACH2(*bucket, raced, hnext) {
+        if (strcmp(raced->path, dir) == 0)
+            break;
+    }
+    if (raced == NULL && generation == dir_cache_generation) {
+        entry->refs++;
+        DL_APPEND2(*bucket, entry, hprev, hnext);
+        DL_PREPEND(dir_lru, entry);
+        if (++dir_cache_count > dir_cache_size)
+            dir_cache_remove(dir_lru->prev);
+    }
+    pthread_mutex_unlock(&dir_cache_lock);
+    return entry;
+}
+
+/*
+ * Returns the directory holding path with a reference held and points name
+ * at the last component, which is empty for "/".
+ */
+static struct dir_fd *resolve_parent(const char *path, const char **name,
+                                     bool may_open)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+    *name = slash + 1;
+    if (slash == path)
+        return &root_dir;
+    char dir[slash - path + 1];
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    return get_dir_fd(dir, may_open);
+}
+
+/* Relative path for openat_beneath from root_fd */
+static const char *beneath_root(const char *path)
+{
+    return path[0] == '/' && path[1] != '\0' ? path + 1 : ".";
+}
+
+static bool plain_name(const char *name)
+{
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/* stat() of a path relative to stor_dir that never leaves it. */
+static int stat_beneath(const char *path, struct stat *st)
+{
+    const char *name;
+    struct dir_fd *dir = resolve_parent(path, &name, true);
+    if (dir == NULL)
+        return -1;
+    int res = 0;
+    if (name[0] == '\0')
+        res = fstat(dir->fd, st);
+    else if (plain_name(name))
+        res = fstatat(dir->fd, name, st, AT_SYMLINK_NOFOLLOW);
+    if ((name[0] != '\0' && !plain_name(name)) ||
+        (res == 0 && S_ISLNK(st->st_mode))) {
+        int fd = openat_beneath(root_fd, beneath_root(path), O_PATH);
+        res = fd < 0 ? -1 : fstat(fd, st);
+        if (fd >= 0)
+            close(fd);
+    }
+    int error = errno;
+    put_dir_fd(dir);
+    errno = error == EXDEV ? EACCES : error;
+    return res;
+}
+
+/* open() of a path relative to stor_dir that never leaves it. */
+static int open_beneath(const char *path, int flags)
+{
+    const char *name;
+    struct dir_fd *dir = resolve_parent(path, &name, true);
+    if (dir == NULL)
+        return -1;
+    int fd = -1;
+    errno = EXDEV;
+    if (plain_name(name))
+        fd = openat_beneath(dir->fd, name, flags);
+    /* Symlinks leaving the parent may still stay below stor_dir. */
+    if (fd < 0 && errno == EXDEV)
+        fd = openat_beneath(root_fd, beneath_root(path), flags);
+    int error = errno;
+    put_dir_fd(dir);
+    errno = error == EXDEV ? EACCES : error;
+    return fd;
+}
+
+/*
+ * The stat and directory caches and the leases learn about changes through
+ * inotify.
+ */
+static void watches_init(void)
+{
+    int i;
+    for (i = 0; i < STAT_CACHE_SHARDS; i++)
+        pthread_mutex_init(&stat_cache[i].lock, NULL);
+    if (stat_cache_size == 0 && dir_cache_size == 0 && !grant_leases)
+        return;
+    if ((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "inotify unavailable, not caching stat results or "
+                        "directories, nor granting leases: %s\n",
+                strerror(errno));
+        stat_cache_size = 0;
+        dir_cache_size = 0;
+        grant_leases = false;
+        return;
+    }
+    pthread_t t;
+    pthread_create(&t, NULL, inotify_thread, NULL);
+    pthread_detach(t);
+}
+
+static struct stat_cache_shard *stat_cache_shard(const char *path,
+                                                 struct stat_entry ***bucket)
+{
+    uint32_t hash = netfs_hash(path, strlen(path));
+    struct stat_cache_shard *shard = &stat_cache[hash % STAT_CACHE_SHARDS];
+    *bucket = &shard->buckets[hash / STAT_CACHE_SHARDS % STAT_CACHE_BUCKETS];
+    return shard;
+}
+
+/* Must be called with the shard lock held. */
+static struct stat_entry *stat_cache_find(struct stat_entry *bucket,
+                                          const char *path)
+{
+    struct stat_entry *entry;
+    DL_FOREACH2(bucket, entry, hnext) {
+        if (strcmp(entry->path, path) == 0)
+            break;
+    }
+    return entry;
+}
+
+/* Must be called with the shard lock held. */
+static void stat_cache_remove(struct stat_cache_shard *shard,
+                              struct stat_entry **bucket,
+                              struct stat_entry *entry)
+{
+    DL_DELETE2(*bucket, entry, hprev, hnext);
+    DL_DELETE(shard->lru, entry);
+    shard->size--;
+    free(entry->path);
+    free(entry);
+}
+
+/*
+ * Returns true on a hit, with error set to 0 or to the cached ENOENT. On a
+ * miss generation is set for the stat_cache_insert that follows.
+ */
+static bool stat_cache_lookup(const char *path, struct stat *st, int *error,
+                              uint64_t *generation)
+{
+    struct stat_entry **bucket;
+    struct stat_cache_shard *shard = stat_cache_shard(path, &bucket);
+    pthread_mutex_lock(&shard->lock);
+    struct stat_entry *entry = stat_cache_find(*bucket, path);
+    if (entry != NULL) {
+        *st = entry->st;
+        *error = entry->error;
+        DL_DELETE(shard->lru, entry);
+        DL_PREPEND(shard->lru, entry);
+    }
+    *generation = shard->generation;
+    pthread_mutex_unlock(&shard->lock);
+    return entry != NULL;
+}
+
+static void stat_cache_insert(const char *path, const struct stat *st,
+                              int error, uint64_t generation)
+{
+    struct stat_entry **bucket;
+    struct stat_cache_shard *shard = stat_cache_shard(path, &bucket);
+    int shard_size =
+        (stat_cache_size + STAT_CACHE_SHARDS - 1) / STAT_CACHE_SHARDS;
+    pthread_mutex_lock(&shard->lock);
+    /* Something changed while path was being stat'ed. */
+    if (shard->generation != generation) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    struct stat_entry *entry = stat_cache_find(*bucket, path);
+    if (entry == NULL) {
+        entry = malloc(sizeof(struct stat_entry));
+        entry->path = strdup(path);
+        DL_APPEND2(*bucket, entry, hprev, hnext);
+        DL_PREPEND(shard->lru, entry);
+        shard->size++;
+    }
+    entry->st = *st;
+    entry->error = error;
+    while (shard->size > shard_size) {
+        struct stat_entry *victim = shard->lru->prev;
+        struct stat_entry **victim_bucket;
+        stat_cache_shard(victim->path, &victim_bucket);
+        stat_cache_remove(shard, victim_bucket, victim);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void stat_cache_invalidate(const char *path)
+{
+    struct stat_entry **bucket;
+    struct stat_cache_shard *shard = stat_cache_shard(path, &bucket);
+    pthread_mutex_lock(&shard->lock);
+    struct stat_entry *entry = stat_cache_find(*bucket, path);
+    if (entry != NULL)
+        stat_cache_remove(shard, bucket, entry);
+    shard->generation++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* For changes that may affect any path below a directory. */
+static void stat_cache_flush(void)
+{
+    int i;
+    for (i = 0; i < STAT_CACHE_SHARDS; i++) {
+        struct stat_cache_shard *shard = &stat_cache[i];
+        pthread_mutex_lock(&shard->lock);
+        struct stat_entry *entry, *tmp;
+        DL_FOREACH_SAFE(shard->lru, entry, tmp) {
+            struct stat_entry **bucket;
+            stat_cache_shard(entry->path, &bucket);
+            stat_cache_remove(shard, bucket, entry);
+        }
+        shard->generation++;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/* Looks dir up without adding a watch, which may block on the disk. */
+static bool dir_watched(const char *dir)
+{
+    uint32_t hash = netfs_hash(dir, strlen(dir));
+    struct dir_watch *watch;
+    pthread_mutex_lock(&watches_lock);
+    DL_FOREACH2(watches_by_path[hash % WATCH_BUCKETS], watch, pnext) {
+        if (strcmp(watch->path, dir) == 0)
+            break;
+    }
+    pthread_mutex_unlock(&watches_lock);
+    return watch != NULL;
+}
+
+/* Returns false if dir, relative to stor_dir, cannot be watched. */
+static bool watch_dir(const char *dir)
+{
+    uint32_t hash = netfs_hash(dir, strlen(dir));
+    struct dir_watch *watch;
+    pthread_mutex_lock(&watches_lock);
+    DL_FOREACH2(watches_by_path[hash % WATCH_BUCKETS], watch, pnext) {
+        if (strcmp(watch->path, dir) == 0) {
+            pthread_mutex_unlock(&watches_lock);
+            return true;
+        }
+    }
+    char full_path[strlen(stor_dir) + strlen(dir) + 1];
+    strcpy(full_path, stor_dir);
+    strcat(full_path, dir);
+    int wd = inotify_add_watch(inotify_fd, full_path, WATCH_EVENTS);
+    if (wd < 0) {
+        pthread_mutex_unlock(&watches_lock);
+        return false;
+    }
+    /* Already watched under another name, events would miss this one */
+    DL_FOREACH2(watches_by_wd[wd % WATCH_BUCKETS], watch, wnext) {
+        if (watch->wd == wd) {
+            pthread_mutex_unlock(&watches_lock);
+            errno = EEXIST;
+            return false;
+        }
+    }
+    watch = malloc(sizeof(struct dir_watch));
+    watch->path = strdup(dir);
+    watch->wd = wd;
+    DL_APPEND2(watches_by_path[hash % WATCH_BUCKETS], watch, pprev, pnext);
+    DL_APPEND2(watches_by_wd[wd % WATCH_BUCKETS], watch, wprev, wnext);
+    pthread_mutex_unlock(&watches_lock);
+    return true;
+}
+
+/*
+ * Copies the parent of path into dir, sized strlen(path) + 2. Returns false
+ * for paths that are never watched.
+ */
+static bool parent_path(const char *path, char *dir)
+{
+    if (strstr(path, "/..") != NULL)
+        return false;
+    strcpy(dir, path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+        return false;
+    slash[slash == dir ? 1 : 0] = '\0';
+    return true;
+}
+
+/*
+ * Watches everything whose change must invalidate path: its parent, which
+ * reports changes to path, and path itself if it is a directory, whose
+ * mtime and nlink change with its entries. Returns false if changes to
+ * path would go unnoticed.
+ */
+static bool watch_path(const char *path)
+{
+    char dir[strlen(path) + 2];
+    if (!parent_path(path, dir) || !watch_dir(dir))
+        return false;
+    /* Fails with ENOTDIR for anything else, then only the parent matters. */
+    return watch_dir(path) || errno == ENOTDIR || errno == ENOENT;
+}
+
+/* Whether watch_path found the parent of path watched already. */
+static bool parent_watched(const char *path)
+{
+    char dir[strlen(path) + 2];
+    return parent_path(path, dir) && dir_watched(dir);
+}
+
+/* Returns false if the result for path must not be cached. */
+static bool stat_cache_watch(const char *path)
+{
+    return stat_cache_size != 0 && watch_path(path);
+}
+
+static void send_invalidate(struct client_connection *con, const char *path)
+{
+    uint32_t send_payload_length = strlen(path);
+    uint8_t packet[NETFS_PACKET_SIZE(send_payload_length)];
+    PREP_NETFS_HEADER(packet, send_payload_length, INVALIDATE, 0);
+    memcpy(NETFS_PAYLOAD(packet), path, send_payload_length);
+    send_packet(con, packet, sizeof(packet));
+}
+
+/* Must be called with leases_lock held. */
+static void remove_lease(struct lease *lease)
+{
+    DL_DELETE2(leases[lease->hash % LEASE_BUCKETS], lease, hprev, hnext);
+    DL_DELETE(lease->con->leases, lease);
+    lease->con->lease_count--;
+    free(lease->path);
+    free(lease);
+}
+
+/* Must be called with leases_lock held, makes a lease found the newest. */
+static struct lease *find_lease(struct client_connection *con,
+                                const char *path, uint32_t hash)
+{
+    struct lease *lease;
+    DL_FOREACH2(leases[hash % LEASE_BUCKETS], lease, hnext) {
+        if (lease->con == con && lease->hash == hash &&
+            strcmp(lease->path, path) == 0)
+            break;
+    }
+    if (lease != NULL) {
+        DL_DELETE(con->leases, lease);
+        DL_APPEND(con->leases, lease);
+    }
+    return lease;
+}
+
+/* Returns false if con still needs grant_lease for path, which may block. */
+static bool renew_lease(struct client_connection *con, const char *path)
+{
+    if (!grant_leases || !(con->caps & NETFS_CAP_INVALIDATE))
+        return true;
+    uint32_t hash = netfs_hash(path, strlen(path));
+    pthread_mutex_lock(&leases_lock);
+    bool held = find_lease(con, path, hash) != NULL;
+    pthread_mutex_unlock(&leases_lock);
+    return held;
+}
+
+/*
+ * Promises con an INVALIDATE once path changes, if the client takes them.
+ * Must be called before path is looked at for the response, so that no
+ * change slips in between unreported.
+ */
+static void grant_lease(struct client_connection *con, const char *path)
+{
+    if (!grant_leases || !(con->caps & NETFS_CAP_INVALIDATE))
+        return;
+    uint32_t hash = netfs_hash(path, strlen(path));
+    char *evicted = NULL;
+    uint64_t generation = 0;
+    bool watched = false;
+    pthread_mutex_lock(&leases_lock);
+    while (find_lease(con, path, hash) == NULL) {
+        /* A flush since the watch was added may have dropped it. */
+        if (watched && generation == leases_generation) {
+            if (con->lease_count == MAX_LEASES) {
+                /* The client forgets what the oldest covered. */
+                evicted = strdup(con->leases->path);
+                remove_lease(con->leases);
+            }
+            struct lease *lease = malloc(sizeof(struct lease));
+            lease->path = strdup(path);
+            lease->hash = hash;
+            lease->con = con;
+            DL_APPEND2(leases[hash % LEASE_BUCKETS], lease, hprev, hnext);
+            DL_APPEND(con->leases, lease);
+            con->lease_count++;
+            break;
+        }
+        generation = leases_generation;
+        pthread_mutex_unlock(&leases_lock);
+        /* Watches stay until a flush, which revokes every lease. */
+        if (!watch_path(path))
+            return;
+        watched = true;
+        pthread_mutex_lock(&leases_lock);
+    }
+    pthread_mutex_unlock(&leases_lock);
+    if (evicted != NULL) {
+        send_invalidate(con, evicted);
+        free(evicted);
+    }
+}
+
+/* Sends INVALIDATE to the holders of leases on path, revoking them. */
+static void revoke_leases(const char *path)
+{
+    if (!grant_leases)
+        return;
+    uint32_t hash = netfs_hash(path, strlen(path));
+    struct lease *lease, *tmp;
+    pthread_mutex_lock(&leases_lock);
+    DL_FOREACH_SAFE2(leases[hash % LEASE_BUCKETS], lease, tmp, hnext) {
+        if (lease->hash == hash && strcmp(lease->path, path) == 0) {
+            send_invalidate(lease->con, path);
+            remove_lease(lease);
+        }
+    }
+    pthread_mutex_unlock(&leases_lock);
+}
+
+/* For changes that can not be pinned on paths, everything is revoked. */
+static void revoke_all_leases(void)
+{
+    if (!grant_leases)
+        return;
+    int i;
+    pthread_mutex_lock(&leases_lock);
+    for (i = 0; i < LEASE_BUCKETS; i++) {
+        while (leases[i] != NULL) {
+            struct client_connection *con = leases[i]->con;
+            send_invalidate(con, "");
+            while (con->leases != NULL)
+                remove_lease(con->leases);
+        }
+    }
+    leases_generation++;
+    pthread_mutex_unlock(&leases_lock);
+}
+
+/* Forgets the leases of a connection that is going away. */
+static void drop_leases(struct client_connection *con)
+{
+    pthread_mutex_lock(&leases_lock);
+    while (con->leases != NULL)
+        remove_lease(con->leases);
+    pthread_mutex_unlock(&leases_lock);
+}
+
+/* stat() for a path relative to stor_dir, served from the cache if possible */
+static int cached_stat(const char *path, struct stat *st)
+{
+    int error;
+    uint64_t generation;
+    if (stat_cache_lookup(path, st, &error, &generation)) {
+        errno = error;
+        return error != 0 ? -1 : 0;
+    }
+    bool cacheable = stat_cache_watch(path);
+    int res = stat_beneath(path, st);
+    error = res < 0 ? errno : 0;
+    if (cacheable && (error == 0 || error == ENOENT))
+        stat_cache_insert(path, st, error, generation);
+    errno = error;
+    return res;
+}
+
+static void flush_caches(void)
+{
+    stat_cache_flush();
+    dir_cache_flush();
+    revoke_all_leases();
+}
+
+/* Invalidates cached results affected by inotify events. */
+void *inotify_thread(void *arg)
+{
+    uint8_t buf[64 * 1024]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno != EINTR)
+                fprintf(stderr, "inotify read failed, Error: %s\n",
+                        strerror(errno));
+            continue;
+        }
+        ssize_t offset;
+        for (offset = 0; offset < len;) {
+            struct inotify_event *event =
+                (struct inotify_event *)(buf + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                flush_caches();
+                continue;
+            }
+
+            struct dir_watch *watch;
+            pthread_mutex_lock(&watches_lock);
+            DL_FOREACH2(watches_by_wd[event->wd % WATCH_BUCKETS], watch,
+                        wnext) {
+                if (watch->wd == event->wd)
+                    break;
+            }
+            if (watch == NULL) {
+                pthread_mutex_unlock(&watches_lock);
+                continue;
+            }
+            /* The watch is gone or its path is stale. */
+            if (event->mask & (IN_IGNORED | IN_MOVE_SELF | IN_DELETE_SELF)) {
+                uint32_t hash = netfs_hash(watch->path, strlen(watch->path));
+                DL_DELETE2(watches_by_path[hash % WATCH_BUCKETS], watch, pprev,
+                           pnext);
+                DL_DELETE2(watches_by_wd[watch->wd % WATCH_BUCKETS], watch,
+                           wprev, wnext);
+                if (!(event->mask & IN_IGNORED))
+                    inotify_rm_watch(inotify_fd, watch->wd);
+                pthread_mutex_unlock(&watches_lock);
+                free(watch->path);
+                free(watch);
+                flush_caches();
+                continue;
+            }
+            char dir[strlen(watch->path) + 1];
+            strcpy(dir, watch->path);
+            pthread_mutex_unlock(&watches_lock);
+
+            stat_cache_invalidate(dir);
+            /* Holders of dir may have its entries from READDIRPLUS too. */
+            revoke_leases(dir);
+            if (event->len == 0)
+                continue;
+            char path[strlen(dir) + event->len + 2];
+            snprintf(path, sizeof(path), "%s/%s",
+                     strcmp(dir, "/") == 0 ? "" : dir, event->name);
+            stat_cache_invalidate(path);
+            revoke_leases(path);
+            /* Paths below a moved or removed directory changed as well. */
+            if ((event->mask & IN_ISDIR) &&
+                (event->mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE)))
+                flush_caches();
+        }
+    }
+    return NULL;
+}
+
+static void free_cached_fd(struct cached_fd *cfd)
+{
+    if (use_uring)
+        uring_close(cfd->fd);
+    else
+        close(cfd->fd);
+    free(cfd->path);
+    free(cfd);
+}
+
+static void put_cached_fd(struct cached_fd *cfd)
+{
+    pthread_mutex_lock(&cfd->shard->lock);
+    int refs = --cfd->refs;
+    pthread_mutex_unlock(&cfd->shard->lock);
+    if (refs == 0)
+        free_cached_fd(cfd);
+}
+
+/* Must be called with the shard lock held, drops the cache's reference. */
+static void fd_cache_remove(struct cached_fd *cfd)
+{
+    struct fd_cache_shard *shard = cfd->shard;
+    uint32_t bucket = netfs_hash(cfd->path, strlen(cfd->path)) /
+                      FD_CACHE_SHARDS % FD_CACHE_BUCKETS;
+    DL_DELETE2(shard->buckets[bucket], cfd, hprev, hnext);
+    DL_DELETE(shard->lru, cfd);
+    shard->size--;
+    if (--cfd->refs == 0)
+        free_cached_fd(cfd);
+}
+
+/*
+ * Returns a referenced read-only descriptor for path, relative to stor_dir,
+ * reusing the cached one unless path now names another inode. Sets errno
+ * and returns NULL on failure.
+ */
+static struct cached_fd *get_cached_fd(const char *path)
+{
+    struct stat st;
+    if (cached_stat(path, &st) < 0)
+        return NULL;
+
+    size_t path_len = strlen(path);
+    uint32_t hash = netfs_hash(path, path_len);
+    struct fd_cache_shard *shard = &fd_cache[hash % FD_CACHE_SHARDS];
+    struct cached_fd **bucket =
+        &shard->buckets[hash / FD_CACHE_SHARDS % FD_CACHE_BUCKETS];
+
+    struct cached_fd *cfd;
+    pthread_mutex_lock(&shard->lock);
+    DL_FOREACH2(*bucket, cfd, hnext) {
+        if (strcmp(cfd->path, path) == 0)
+            break;
+    }
+    if (cfd != NULL) {
+        if (cfd->dev == st.st_dev && cfd->ino == st.st_ino) {
+            cfd->refs++;
+            DL_DELETE(shard->lru, cfd);
+            DL_PREPEND(shard->lru, cfd);
+            pthread_mutex_unlock(&shard->lock);
+            return cfd;
+        }
+        /* Replaced or renamed over since it was opened */
+        fd_cache_remove(cfd);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    int fd = open_beneath(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    fstat(fd, &st);
+    cfd = malloc(sizeof(struct cached_fd));
+    cfd->path = strdup(path);
+    cfd->fd = fd;
+    cfd->dev = st.st_dev;
+    cfd->ino = st.st_ino;
+    cfd->regular = S_ISREG(st.st_mode);
+    cfd->refs = 1;
+    cfd->shard = shard;
+    if (fd_cache_size == 0)
+        return cfd;
+
+    int shard_size = (fd_cache_size + FD_CACHE_SHARDS - 1) / FD_CACHE_SHARDS;
+    struct cached_fd *raced;
+    pthread_mutex_lock(&shard->lock);
+    DL_FOREACH2(*bucket, raced, hnext) {
+        if (strcmp(raced->path, path) == 0)
+            break;
+    }
+    if (raced != NULL)
+        fd_cache_remove(raced);
+    cfd->refs++;
+    DL_APPEND2(*bucket, cfd, hprev, hnext);
+    DL_PREPEND(shard->lru, cfd);
+    shard->size++;
+    while (shard->size > shard_size)
+        fd_cache_remove(shard->lru->prev);
+    pthread_mutex_unlock(&shard->lock);
+    return cfd;
+}
+
+static void put_open_file(struct open_file *file)
+{
+    pthread_mutex_lock(&open_files_lock);
+    int refs = --file->refs;
+    pthread_mutex_unlock(&open_files_lock);
+    if (refs == 0) {
+        put_cached_fd(file->cached);
+        pthread_mutex_destroy(&file->stream_lock);
+        free(file);
+    }
+}
+
+/*
+ * Returns the file with a reference held, or NULL for a handle that is
+ * unknown or was opened by another client.
+ */
+static struct open_file *get_open_file(struct client_connection *con,
+                                       uint64_t handle)
+{
+    struct open_file *file;
+    pthread_mutex_lock(&open_files_lock);
+    DL_FOREACH2(open_files[handle % HANDLE_BUCKETS], file, hnext) {
+        if (file->handle == handle)
+            break;
+    }
+    if (file != NULL && file->owner != con &&
+        (con->session == 0 || file->owner->session != con->session))
+        file = NULL;
+    if (file != NULL)
+        file->refs++;
+    pthread_mutex_unlock(&open_files_lock);
+    return file;
+}
+
+static uint64_t add_open_file(struct client_connection *con,
+                              struct cached_fd *cfd)
+{
+    struct open_file *file = calloc(1, sizeof(struct open_file));
+    file->cached = cfd;
+    file->fd = cfd->fd;
+    file->refs = 1;
+    file->owner = con;
+    pthread_mutex_init(&file->stream_lock, NULL);
+    pthread_mutex_lock(&open_files_lock);
+    file->handle = next_handle++;
+    DL_APPEND2(open_files[file->handle % HANDLE_BUCKETS], file, hprev, hnext);
+    DL_APPEND(con->files, file);
+    pthread_mutex_unlock(&open_files_lock);
+    return file->handle;
+}
+
+static void advise(int fd, uint64_t offset, uint64_t length, int advice)
+{
+    if (use_uring)
+        uring_fadvise(fd, offset, length, advice);
+    else
+        posix_fadvise(fd, offset, length, advice);
+}
+
+/*
+ * Follows the reads of a handle. Sequential streams get the pages ahead of
+ * them requested early, and long ones, likely one-pass scans, give the
+ * pages well behind them back so they don't push out everybody else's.
+ * Client readahead arrives slightly out of order, hence STREAM_SLACK.
+ */
+static void track_stream(struct open_file *file, uint64_t offset,
+                         uint64_t count)
+{
+    if (!prefetch)
+        return;
+    uint64_t end = offset + count;
+    uint64_t prefetch_from = 0, prefetch_length = 0;
+    uint64_t drop_from = 0, drop_length = 0;
+
+    pthread_mutex_lock(&file->stream_lock);
+    if (offset + STREAM_SLACK >= file->stream_next &&
+        offset <= file->stream_next + STREAM_SLACK) {
+        file->stream_length += count;
+    } else {
+        file->stream_length = count;
+        file->prefetched = end;
+        file->dropped = offset;
+    }
+    if (end > file->stream_next)
+        file->stream_next = end;
+
+    /* Renewed once half of the window has been consumed */
+    if (file->stream_length >= PREFETCH_TRIGGER &&
+        file->prefetched < end + PREFETCH_WINDOW / 2) {
+        prefetch_from = file->prefetched > end ? file->prefetched : end;
+        prefetch_length = end + PREFETCH_WINDOW - prefetch_from;
+        file->prefetched = end + PREFETCH_WINDOW;
+    }
+    if (file->stream_length >= DROP_BEHIND_TRIGGER &&
+        offset >= file->dropped + DROP_BEHIND_LAG + DROP_BEHIND_CHUNK) {
+        drop_from = file->dropped;
+        drop_length = offset - DROP_BEHIND_LAG - drop_from;
+        file->dropped += drop_length;
+    }
+    pthread_mutex_unlock(&file->stream_lock);
+
+    if (prefetch_length > 0)
+        advise(file->fd, prefetch_from, prefetch_length,
+               POSIX_FADV_WILLNEED);
+    if (drop_length > 0)
+        advise(file->fd, drop_from, drop_length, POSIX_FADV_DONTNEED);
+}
+
+/* Must be called with open_files_lock held. */
+static void remove_open_file(struct open_file *file)
+{
+    DL_DELETE2(open_files[file->handle % HANDLE_BUCKETS], file, hprev, hnext);
+    DL_DELETE(file->owner->files, file);
+}
+
+static void put_connection(struct client_connection *con)
+{
+    pthread_mutex_lock(&con->lock);
+    int refs = --con->refs;
+    pthread_mutex_unlock(&con->lock);
+    if (refs == 0) {
+        /*
+         * Close what the client did not release. Clearing the owner keeps a
+         * RELEASE racing in on another connection of the session from
+         * removing the file again.
+         */
+        struct open_file *files, *file, *tmp;
+        pthread_mutex_lock(&open_files_lock);
+        files = con->files;
+        DL_FOREACH(files, file) {
+            DL_DELETE2(open_files[file->handle % HANDLE_BUCKETS], file, hprev,
+                       hnext);
+            file->owner = NULL;
+        }
+        pthread_mutex_unlock(&open_files_lock);
+        DL_FOREACH_SAFE(files, file, tmp) {
+            put_open_file(file);
+        }
+        drop_leases(con);
+        if (con->shm != NULL)
+            netfs_shm_free(con->shm);
+        close(con->socket_fd);
+        pthread_mutex_destroy(&con->send_lock);
+        pthread_mutex_destroy(&con->lock);
+        free(con->input);
+        free(con);
+    }
+}
+
+static void handle_getattr(struct netfs_request *req)
+{
+    char *path = (char *)req->payload;
+    struct stat tmp_st;
+    grant_lease(req->con, path);
+    if (cached_stat(path, &tmp_st) < 0) {
+        send_error(req, errno);
+        return;
+    }
+    send_attrs(req, &tmp_st);
+}
+
+/*
+ * Attributes of the entry name of the directory path, open as dir_fd, as
+ * GETATTR of the entry would give them: symlinks are followed only while
+ * they stay beneath stor_dir, and stor_dir is its own parent. Entries go
+ * through the stat cache, which only keeps them if path is watched.
+ */
+static int stat_dir_entry(int dir_fd, const char *path, const char *name,
+                          bool watched, struct stat *st)
+{
+    if (strcmp(name, ".") == 0)
+        return fstat(dir_fd, st);
+    if (strcmp(name, "..") == 0) {
+        struct stat root_st;
+        if (fstat(dir_fd, st) < 0 || fstat(root_fd, &root_st) < 0)
+            return -1;
+        if (st->st_dev == root_st.st_dev && st->st_ino == root_st.st_ino)
+            return 0;
+        return fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW);
+    }
+    size_t path_len = strlen(path);
+    if (path_len > 0 && path[path_len - 1] == '/')
+        path_len--;
+    char entry_path[path_len + 1 + strlen(name) + 1];
+    memcpy(entry_path, path, path_len);
+    entry_path[path_len] = '/';
+    strcpy(&entry_path[path_len + 1], name);
+
+    int error;
+    uint64_t generation;
+    if (stat_cache_lookup(entry_path, st, &error, &generation)) {
+        errno = error;
+        return error != 0 ? -1 : 0;
+    }
+    int res = fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW);
+    if (res == 0 && S_ISLNK(st->st_mode))
+        res = stat_beneath(entry_path, st);
+    error = res < 0 ? errno : 0;
+    bool cacheable = watched && (error == 0 || error == ENOENT);
+    /* As in watch_path, a directory also needs its own watch. */
+    if (cacheable && error == 0 && S_ISDIR(st->st_mode))
+        cacheable = watch_dir(entry_path) || errno == ENOTDIR ||
+                    errno == ENOENT;
+    if (cacheable)
+        stat_cache_insert(entry_path, st, error, generation);
+    errno = error;
+    return res;
+}
+
+/*
+ * Sends one bounded page of the directory, starting after the entry whose
+ * cookie the client sent. Cookies are getdents64 offsets, so the server
+ * keeps no state between pages.
+ */
+static void handle_readdir(struct netfs_request *req, bool plus)
+{
+    if (req->header.payload_length < sizeof(struct netfs_readdir)) {
+        send_error(req, EINVAL);
+        return;
+    }
+    uint64_t cookie =
+        be64toh(((struct netfs_readdir *)req->payload)->cookie);
+    char *path = (char *)req->payload + sizeof(struct netfs_readdir);
+    /* The entries' attributes are covered by the directory's lease. */
+    bool watched = false;
+    if (plus) {
+        grant_lease(req->con, path);
+        watched = stat_cache_size != 0 && strstr(path, "/..") == NULL &&
+                  watch_dir(path);
+    }
+    int dir_fd;
+    if ((dir_fd = open_beneath(path, O_RDONLY | O_DIRECTORY)) < 0) {
+        send_error(req, errno);
+        return;
+    }
+    if (cookie != 0 && lseek(dir_fd, cookie, SEEK_SET) < 0) {
+        send_error(req, errno);
+        close(dir_fd);
+        return;
+    }
+
+    /* Entry: netfs_attrs (READDIRPLUS only), cookie, name length, name */
+    uint8_t *send_packet = netfs_buf_alloc(READDIR_PAGE_SIZE);
+    uint8_t *send_payload = (uint8_t *)NETFS_PAYLOAD(send_packet);
+    uint8_t *dents = netfs_buf_alloc(READDIR_PAGE_SIZE);
+    uint32_t send_payload_length = 1; /* The eof byte */
+    bool full = false;
+    bool eof = false;
+    int error = 0;
+    while (!full) {
+        ssize_t dents_size = getdents64(dir_fd, dents, READDIR_PAGE_SIZE);
+        if (dents_size < 0) {
+            error = errno;
+            break;
+        }
+        if (dents_size == 0) {
+            eof = true;
+            break;
+        }
+        ssize_t offset;
+        struct dirent64 *entry;
+        for (offset = 0; offset < dents_size; offset += entry->d_reclen) {
+            entry = (struct dirent64 *)(dents + offset);
+            uint8_t str_length = strlen(entry->d_name);
+            size_t entry_size = (plus ? sizeof(struct netfs_attrs) : 0) +
+                                sizeof(uint64_t) + 1 + str_length;
+            if (NETFS_PACKET_SIZE(send_payload_length + entry_size) >
+                READDIR_PAGE_SIZE) {
+                full = true;
+                break;
+            }
+            uint8_t *send_entry = send_payload + send_payload_length;
+            if (plus) {
+                struct stat entry_st;
+                /* Withheld (mode 0) if it escapes or went away. */
+                if (stat_dir_entry(dir_fd, path, entry->d_name, watched,
+                                   &entry_st) < 0)
+                    memset(&entry_st, 0, sizeof(entry_st));
+                fill_attrs((struct netfs_attrs *)send_entry, &entry_st);
+                send_entry += sizeof(struct netfs_attrs);
+            }
+            *(uint64_t *)send_entry = htobe64(entry->d_off);
+            send_entry += sizeof(uint64_t);
+            send_entry[0] = str_length;
+            memcpy(send_entry + 1, entry->d_name, str_length);
+            send_payload_length += entry_size;
+        }
+    }
+    if (error != 0) {
+        send_error(req, error);
+    } else {
+        send_payload[0] = eof;
+        PREP_NETFS_HEADER(send_packet, send_payload_length,
+                          plus ? READDIRPLUS_R : READDIR_R, req->header.tag);
+        send_response(req, send_packet,
+                      NETFS_PACKET_SIZE(send_payload_length));
+    }
+    netfs_buf_free(dents);
+    netfs_buf_free(send_packet);
+    close(dir_fd);
+}
+
+static void handle_open(struct netfs_request *req)
+{
+    char *path = (char *)req->payload;
+    struct cached_fd *cfd;
+    if ((cfd = get_cached_fd(path)) == NULL) {
+        send_error(req, errno);
+        return;
+    }
+
+    uint32_t send_payload_length = sizeof(uint64_t);
+    uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
+    PREP_NETFS_HEADER(send_packet, send_payload_length, OPEN_R,
+                      req->header.tag);
+    *(uint64_t *)NETFS_PAYLOAD(send_packet) =
+        htobe64(add_open_file(req->con, cfd));
+    send_response(req, send_packet, NETFS_PACKET_SIZE(send_payload_length));
+}
+
+static void handle_release(struct netfs_request *req)
+{
+    if (req->header.payload_length != sizeof(uint64_t)) {
+        send_error(req, EINVAL);
+        return;
+    }
+    struct open_file *file =
+        get_open_file(req->con, be64toh(*(uint64_t *)req->payload));
+    if (file == NULL) {
+        send_error(req, EBADF);
+        return;
+    }
+    pthread_mutex_lock(&open_files_lock);
+    if (file->owner != NULL) {
+        remove_open_file(file);
+        file->owner = NULL;
+        file->refs--; /* The table's reference */
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    put_open_file(file);
+
+    uint8_t send_packet[NETFS_HEADER_SIZE];
+    PREP_NETFS_HEADER(send_packet, 0, RELEASE_R, req->header.tag);
+    send_response(req, send_packet, NETFS_HEADER_SIZE);
+}
+
+static void handle_read(struct netfs_request *req)
+{
+    if (req->header.payload_length != sizeof(struct netfs_read_write)) {
+        send_error(req, EINVAL);
+        return;
+    }
+    struct netfs_read_write *inf = (struct netfs_read_write *)req->payload;
+    inf->handle = be64toh(inf->handle);
+    inf->count = be64toh(inf->count);
+    inf->file_offset = be64toh(inf->file_offset);
+    if (inf->count > req->con->max_read)
+        inf->count = req->con->max_read; /* A short read, not an error */
+
+    struct open_file *file = get_open_file(req->con, inf->handle);
+    if (file == NULL) {
+        send_error(req, EBADF);
+        return;
+    }
+
+    track_stream(file, inf->file_offset, inf->count);
+
+    struct stat st;
+    /*
+     * Rings take copies anyway, sendfile needs a socket. The header goes
+     * out first, so count is clamped to the size now.
+     */
+    if (zero_copy && req->con->shm == NULL && file->cached->regular &&
+        fstat(file->fd, &st) == 0) {
+        uint64_t count = 0;
+        if (inf->file_offset < (uint64_t)st.st_size)
+            count = st.st_size - inf->file_offset;
+        if (count > inf->count)
+            count = inf->count;
+        send_file_response(req, file, inf->file_offset, count);
+        put_open_file(file);
+        return;
+    }
+
+    void *send_packet = netfs_buf_alloc(NETFS_PACKET_SIZE(inf->count));
+    ssize_t read_bytes = pread(file->fd, NETFS_PAYLOAD(send_packet),
+                               inf->count, inf->file_offset);
+    if (read_bytes < 0) {
+        send_error(req, errno);
+    } else {
+        PREP_NETFS_HEADER(send_packet, read_bytes, READ_R, req->header.tag);
+        send_response(req, send_packet, NETFS_PACKET_SIZE(read_bytes));
+    }
+    netfs_buf_free(send_packet);
+    put_open_file(file);
+}
+
+/* Clients send HELLO before anything else on the connection. */
+static void handle_hello(struct netfs_request *req)
+{
+    struct netfs_hello *hello = (struct netfs_hello *)req->payload;
+    if (req->header.payload_length < sizeof(struct netfs_hello) ||
+        ntohl(hello->version) < 1) {
+        send_error(req, EPROTO);
+        return;
+    }
+    uint32_t max_response = ntohl(hello->max_response);
+    if (max_response < READDIR_PAGE_SIZE) {
+        send_error(req, EINVAL);
+        return;
+    }
+    if (max_response < req->con->max_read)
+        req->con->max_read = max_response;
+    req->con->caps = ntohl(hello->capabilities);
+    if (req->header.payload_length >=
+        sizeof(struct netfs_hello) + sizeof(struct netfs_hello_session))
+        req->con->session = be64toh(
+            ((struct netfs_hello_session *)(hello + 1))->session);
+
+    uint8_t send_packet[NETFS_PACKET_SIZE(sizeof(struct netfs_hello))];
+    PREP_NETFS_HEADER(send_packet, sizeof(struct netfs_hello), HELLO_R,
+                      req->header.tag);
+    hello = (struct netfs_hello *)NETFS_PAYLOAD(send_packet);
+    hello->version = htonl(NETFS_VERSION);
+    hello->capabilities =
+        htonl(NETFS_CAP_READDIRPLUS | NETFS_CAP_CANCEL |
+              (grant_leases ? NETFS_CAP_INVALIDATE : 0));
+    hello->max_request = htonl(MAX_REQUEST_SIZE);
+    hello->max_response = htonl(MAX_READ_SIZE);
+    hello->io_size = htonl(PREFERRED_IO_SIZE);
+    send_response(req, send_packet, sizeof(send_packet));
+}
+
+static void handle_request(struct netfs_request *req)
+{
+    switch (req->header.operation) {
+    case HELLO:
+        handle_hello(req);
+        break;
+    case GETATTR:
+        handle_getattr(req);
+        break;
+    case READDIR:
+        handle_readdir(req, false);
+        break;
+    case READDIRPLUS:
+        handle_readdir(req, true);
+        break;
+    case OPEN:
+        handle_open(req);
+        break;
+    case READ:
+        handle_read(req);
+        break;
+    case RELEASE:
+        handle_release(req);
+        break;
+    default:
+        fprintf(stderr, "Unknown packet: %u\n", req->header.operation);
+        send_error(req, ENOSYS);
+        break;
+    }
+
+    finish_request(req);
+}
+
+static void finish_request(struct netfs_request *req)
+{
+    netfs_stats_record(&stats, req->header.operation,
+                       netfs_monotonic_us() - req->received_us, req->failed);
+    put_connection(req->con);
+    netfs_buf_free(req->payload);
+    free(req);
+}
+
+/*
+ * Sends what the socket takes right away and queues the rest for the event
+ * loop. Responses of concurrent handlers never interleave on the socket.
+ */
+static int send_response(struct netfs_request *req, void *packet, size_t size)
+{
+    return send_packet(req->con, packet, size);
+}
+
+/* Sends what it can right away and queues the rest for the event loop. */
+static int send_packet(struct client_connection *con, void *packet,
+                       size_t size)
+{
+    size_t sent = 0;
+    pthread_mutex_lock(&con->send_lock);
+    if (con->closed) {
+        pthread_mutex_unlock(&con->send_lock);
+        return -1;
+    }
+    while (con->output == NULL && sent < size) {
+        struct iovec iov = {(uint8_t *)packet + sent, size - sent};
+        ssize_t sent_bytes = con_writev(con, &iov, 1, 0);
+        if (sent_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            pthread_mutex_unlock(&con->send_lock);
+            shutdown(con->socket_fd, SHUT_RDWR);
+            return -1;
+        }
+        sent += sent_bytes;
+    }
+    if (sent < size) {
+        struct output_buffer *out = calloc(1, sizeof(struct output_buffer));
+        out->size = size - sent;
+        out->data = netfs_buf_alloc(out->size);
+        memcpy(out->data, (uint8_t *)packet + sent, out->size);
+        DL_APPEND(con->output, out);
+        watch_writable(con, true);
+    }
+    pthread_mutex_unlock(&con->send_lock);
+    return 0;
+}
+
+/*
+ * Sends a READ_R header followed by count bytes of file, which the kernel
+ * copies from the page cache to the socket without passing user space.
+ */
+static int send_file_response(struct netfs_request *req,
+                              struct open_file *file, off_t offset,
+                              size_t count)
+{
+    struct client_connection *con = req->con;
+    struct output_buffer *header = calloc(1, sizeof(struct output_buffer));
+    header->data = netfs_buf_alloc(NETFS_HEADER_SIZE);
+    header->size = NETFS_HEADER_SIZE;
+    PREP_NETFS_HEADER(header->data, count, READ_R, req->header.tag);
+
+    struct output_buffer *range = NULL;
+    if (count > 0) {
+        range = calloc(1, sizeof(struct output_buffer));
+        pthread_mutex_lock(&open_files_lock);
+        file->refs++;
+        pthread_mutex_unlock(&open_files_lock);
+        range->file = file;
+        range->file_offset = offset;
+        range->size = count;
+    }
+
+    pthread_mutex_lock(&con->send_lock);
+    if (con->closed) {
+        pthread_mutex_unlock(&con->send_lock);
+        free_output_buffer(header);
+        if (range != NULL)
+            free_output_buffer(range);
+        return -1;
+    }
+    DL_APPEND(con->output, header);
+    if (range != NULL)
+        DL_APPEND(con->output, range);
+    int res = flush_output(con);
+    pthread_mutex_unlock(&con->send_lock);
+    if (res < 0)
+        shutdown(con->socket_fd, SHUT_RDWR);
+    return res;
+}
+
+static int send_error(struct netfs_request *req, int err)
+{
+    req->failed = true;
+    uint32_t send_payload_length = sizeof(uint32_t);
+    uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
+    PREP_NETFS_HEADER(send_packet, send_payload_length, ERROR,
+                      req->header.tag);
+    *(uint32_t *)NETFS_PAYLOAD(send_packet) = htonl(err);
+    return send_response(req, send_packet,
+                         NETFS_PACKET_SIZE(send_payload_length));
+}
+
+static void send_attrs(struct netfs_request *req, const struct stat *st)
+{
+    uint32_t send_payload_length = sizeof(struct netfs_attrs);
+    uint8_t send_packet[NETFS_PACKET_SIZE(send_payload_length)];
+    PREP_NETFS_HEADER(send_packet, send_payload_length, GETATTR_R,
+                      req->header.tag);
+    fill_attrs((struct netfs_attrs *)NETFS_PAYLOAD(send_packet), st);
+    send_response(req, send_packet, NETFS_PACKET_SIZE(send_payload_length));
+}
+
+static void fill_attrs(struct netfs_attrs *attrs, const struct stat *st)
+{
+    attrs->mode = htonl(st->st_mode);
+    attrs->nlink = htonl(st->st_nlink);
+    attrs->uid = htonl(st->st_uid);
+    attrs->gid = htonl(st->st_gid);
+    attrs->size = htonl(st->st_size);
+    attrs->atime = htonl(st->st_atime);
+    attrs->mtime = htonl(st->st_mtime);
+    attrs->ctime = htonl(st->st_ctime);
+}
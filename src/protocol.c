@@ -1,8 +1,47 @@
 
+#define _GNU_SOURCE
 #include "protocol.h"
 
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUF_MIN_SHIFT 8 /* Smallest size class holds 256 bytes */
+#define BUF_CLASSES 13  /* Largest holds NETFS_MAX_BUFFER */
+#define BUF_THREAD_CACHE 8
+#define BUF_SHARED_BYTES (4 * 1024 * 1024) /* Kept free per size class */
+
+/* Precedes every pooled buffer. */
+struct buf_header {
+    uint32_t size_class; /* BUF_CLASSES for oversized buffers */
+    struct buf_header *next; /* While on a free list */
+} __attribute__((aligned(16)));
+
+struct buf_list {
+    struct buf_header *head;
+    int count;
+};
+
+/* Each thread reuses its own buffers first, without taking a lock. */
+static __thread struct buf_list thread_bufs[BUF_CLASSES];
+static __thread int thread_bufs_registered;
+static struct buf_list shared_bufs[BUF_CLASSES];
+static pthread_mutex_t shared_bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_bufs_key;
+static pthread_once_t thread_bufs_once = PTHREAD_ONCE_INIT;
 
 ssize_t sendall(int socket_fd, void *packet, size_t size)
 {
@@ -30,4 +69,613 @@ ssize_t recvall(int socket_fd, void *packet, size_t size)
         size -= recvd_bytes;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+#define SHM_FDS 5 /* The mapping and four eventfds, see netfs_shm_create */
+
+/* Skips bytes already transferred, including any emptied entries. */
+static void iov_advance(struct iovec **iov, int *iovcnt, size_t bytes)
+{
+    while (*iovcnt > 0 && bytes >= (*iov)->iov_len) {
+        bytes -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (uint8_t *)(*iov)->iov_base + bytes;
+        (*iov)->iov_len -= bytes;
+    }
+}
+
+/* Like sendall, for a packet in pieces. The entries of iov are consumed. */
+ssize_t sendallv(int socket_fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    iov_advance(&iov, &iovcnt, 0);
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t sent_bytes = sendmsg(socket_fd, &msg, 0);
+        if (sent_bytes <= 0) /* Lost Connection */
+            return -1;
+        iov_advance(&iov, &iovcnt, sent_bytes);
+    }
+    return 0;
+}
+
+/* Like recvall, filling iov in order. The entries of iov are consumed. */
+ssize_t recvallv(int socket_fd, struct iovec *iov, int iovcnt)
+{
+    iov_advance(&iov, &iovcnt, 0);
+    while (iovcnt > 0) {
+        ssize_t recvd_bytes = readv(socket_fd, iov, iovcnt);
+        if (recvd_bytes <= 0) /* Lost Connection */
+            return -1;
+        iov_advance(&iov, &iovcnt, recvd_bytes);
+    }
+    return 0;
+}
+
+/* 32 bit FNV-1a, used for hashing paths. */
+uint32_t netfs_hash(const char *str, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void buf_push(struct buf_list *list, struct buf_header *header)
+{
+    header->next = list->head;
+    list->head = header;
+    list->count++;
+}
+
+static struct buf_header *buf_pop(struct buf_list *list)
+{
+    struct buf_header *header = list->head;
+    if (header != NULL) {
+        list->head = header->next;
+        list->count--;
+    }
+    return header;
+}
+
+static int buf_shared_limit(uint32_t size_class)
+{
+    int limit = BUF_SHARED_BYTES >> (size_class + BUF_MIN_SHIFT);
+    return limit < BUF_THREAD_CACHE ? BUF_THREAD_CACHE : limit;
+}
+
+/* Hands buffers of exiting threads to the shared lists. */
+static void thread_bufs_release(void *arg)
+{
+    struct buf_list *lists = (struct buf_list *)arg;
+    uint32_t size_class;
+    for (size_class = 0; size_class < BUF_CLASSES; size_class++) {
+        struct buf_header *header;
+        while ((header = buf_pop(&lists[size_class])) != NULL) {
+            pthread_mutex_lock(&shared_bufs_lock);
+            if (shared_bufs[size_class].count < buf_shared_limit(size_class)) {
+                buf_push(&shared_bufs[size_class], header);
+                header = NULL;
+            }
+            pthread_mutex_unlock(&shared_bufs_lock);
+            free(header);
+        }
+    }
+}
+
+static void thread_bufs_key_create(void)
+{
+    pthread_key_create(&thread_bufs_key, thread_bufs_release);
+}
+
+/*
+ * Returns a buffer of at least size bytes from the smallest fitting size
+ * class, reusing freed buffers so request paths stay off the heap.
+ */
+void *netfs_buf_alloc(size_t size)
+{
+    uint32_t size_class = 0;
+    while (size_class < BUF_CLASSES &&
+           ((size_t)1 << (size_class + BUF_MIN_SHIFT)) < size)
+        size_class++;
+    if (size_class == BUF_CLASSES) {
+        struct buf_header *header = malloc(sizeof(struct buf_header) + size);
+        header->size_class = BUF_CLASSES;
+        return header + 1;
+    }
+
+    if (!thread_bufs_registered) {
+        pthread_once(&thread_bufs_once, thread_bufs_key_create);
+        pthread_setspecific(thread_bufs_key, thread_bufs);
+        thread_bufs_registered = 1;
+    }
+    struct buf_header *header = buf_pop(&thread_bufs[size_class]);
+    if (header == NULL) {
+        pthread_mutex_lock(&shared_bufs_lock);
+        header = buf_pop(&shared_bufs[size_class]);
+        pthread_mutex_unlock(&shared_bufs_lock);
+    }
+    if (header == NULL) {
+        header = malloc(sizeof(struct buf_header) +
+                        ((size_t)1 << (size_class + BUF_MIN_SHIFT)));
+        header->size_class = size_class;
+    }
+    return header + 1;
+}
+
+void netfs_buf_free(void *buf)
+{
+    if (buf == NULL)
+        return;
+    struct buf_header *header = (struct buf_header *)buf - 1;
+    uint32_t size_class = header->size_class;
+    if (size_class == BUF_CLASSES) {
+        free(header);
+        return;
+    }
+
+    if (thread_bufs_registered &&
+        thread_bufs[size_class].count < BUF_THREAD_CACHE) {
+        buf_push(&thread_bufs[size_class], header);
+        return;
+    }
+    pthread_mutex_lock(&shared_bufs_lock);
+    if (shared_bufs[size_class].count < buf_shared_limit(size_class)) {
+        buf_push(&shared_bufs[size_class], header);
+        header = NULL;
+    }
+    pthread_mutex_unlock(&shared_bufs_lock);
+    free(header);
+}
+
+/*
+ * Returns the transport address names. For the local ones path is set to
+ * the socket file, TCP addresses are used as they are.
+ */
+int netfs_parse_address(const char *address, const char **path)
+{
+    if (strncmp(address, "unix:", 5) == 0) {
+        *path = address + 5;
+        return NETFS_TRANSPORT_UNIX;
+    }
+    if (strncmp(address, "shm:", 4) == 0) {
+        *path = address + 4;
+        return NETFS_TRANSPORT_SHM;
+    }
+    return NETFS_TRANSPORT_TCP;
+}
+
+static size_t ring_write(struct netfs_ring *ring, const void *src, size_t size)
+{
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (size > NETFS_RING_SIZE - (tail - head))
+        size = NETFS_RING_SIZE - (tail - head);
+    size_t at = tail & (NETFS_RING_SIZE - 1);
+    size_t first = size < NETFS_RING_SIZE - at ? size : NETFS_RING_SIZE - at;
+    memcpy(ring->data + at, src, first);
+    memcpy(ring->data, (const uint8_t *)src + first, size - first);
+    __atomic_store_n(&ring->tail, tail + size, __ATOMIC_SEQ_CST);
+    return size;
+}
+
+static size_t ring_read(struct netfs_ring *ring, void *dest, size_t size)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (size > tail - head)
+        size = tail - head;
+    size_t at = head & (NETFS_RING_SIZE - 1);
+    size_t first = size < NETFS_RING_SIZE - at ? size : NETFS_RING_SIZE - at;
+    memcpy(dest, ring->data + at, first);
+    memcpy((uint8_t *)dest + first, ring->data, size - first);
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_SEQ_CST);
+    return size;
+}
+
+static void shm_signal(int fd)
+{
+    uint64_t value = 1;
+    while (write(fd, &value, sizeof(value)) < 0 && errno == EINTR)
+        ;
+}
+
+/* Blocks until fd is signalled, fails once the peer is gone. */
+static int shm_wait(struct netfs_shm *shm, int fd)
+{
+    struct pollfd fds[2] = {{.fd = fd, .events = POLLIN},
+                            {.fd = shm->sock_fd, .events = POLLRDHUP}};
+    while (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    if (fds[1].revents != 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    uint64_t value;
+    read(fd, &value, sizeof(value));
+    return 0;
+}
+
+/* rings[in] becomes shm->in, fds are data, room, peer data, peer room. */
+static struct netfs_shm *shm_map(int map_fd, int sock_fd, int in, int *fds)
+{
+    struct netfs_ring *rings = mmap(NULL, 2 * sizeof(struct netfs_ring),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED,
+                                    map_fd, 0);
+    if (rings == MAP_FAILED)
+        return NULL;
+    struct netfs_shm *shm = malloc(sizeof(struct netfs_shm));
+    shm->in = &rings[in];
+    shm->out = &rings[1 - in];
+    shm->sock_fd = sock_fd;
+    shm->data_fd = fds[0];
+    shm->room_fd = fds[1];
+    shm->peer_data_fd = fds[2];
+    shm->peer_room_fd = fds[3];
+    return shm;
+}
+
+/*
+ * Server side setup for a connection accepted on a "shm:" address. The
+ * rings live in a memfd which, with the eventfds, is passed to the client
+ * over sock_fd. The server always counts as waiting for data, its event
+ * loop polls data_fd.
+ */
+struct netfs_shm *netfs_shm_create(int sock_fd)
+{
+    int fds[SHM_FDS];
+    int i;
+    fds[0] = memfd_create("netfs", MFD_CLOEXEC);
+    for (i = 1; i < SHM_FDS; i++)
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct netfs_shm *shm = NULL;
+    bool created = true;
+    for (i = 0; i < SHM_FDS; i++)
+        created = created && fds[i] >= 0;
+    if (created && ftruncate(fds[0], 2 * sizeof(struct netfs_ring)) == 0)
+        shm = shm_map(fds[0], sock_fd, 0, &fds[1]);
+    if (shm == NULL) {
+        for (i = 0; i < SHM_FDS; i++) {
+            if (fds[i] >= 0)
+                close(fds[i]);
+        }
+        return NULL;
+    }
+    shm->in->reader_waiting = 1;
+
+    /* The client sees the eventfds the other way around. */
+    int client_fds[SHM_FDS] = {fds[0], fds[3], fds[4], fds[1], fds[2]};
+    uint8_t byte = 0;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr header;
+        uint8_t space[CMSG_SPACE(sizeof(client_fds))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(client_fds));
+    memcpy(CMSG_DATA(cmsg), client_fds, sizeof(client_fds));
+    ssize_t sent_bytes = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+    close(fds[0]);
+    if (sent_bytes != 1) {
+        netfs_shm_free(shm);
+        return NULL;
+    }
+    return shm;
+}
+
+/* Client side of netfs_shm_create, on a connection to a "shm:" address. */
+struct netfs_shm *netfs_shm_attach(int sock_fd)
+{
+    int fds[SHM_FDS];
+    uint8_t byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr header;
+        uint8_t space[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    if (recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return NULL;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        errno = EPROTO;
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    struct netfs_shm *shm = shm_map(fds[0], sock_fd, 1, &fds[1]);
+    close(fds[0]);
+    if (shm == NULL) {
+        int i;
+        for (i = 1; i < SHM_FDS; i++)
+            close(fds[i]);
+    }
+    return shm;
+}
+
+/* Leaves sock_fd to the caller. */
+void netfs_shm_free(struct netfs_shm *shm)
+{
+    munmap(shm->in < shm->out ? shm->in : shm->out,
+           2 * sizeof(struct netfs_ring));
+    close(shm->data_fd);
+    close(shm->room_fd);
+    close(shm->peer_data_fd);
+    close(shm->peer_room_fd);
+    free(shm);
+}
+
+/* Writes what fits without blocking, fails with EAGAIN if nothing does. */
+ssize_t netfs_shm_write(struct netfs_shm *shm, struct iovec *iov, int iovcnt)
+{
+    size_t written = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        size_t size = ring_write(shm->out, iov[i].iov_base, iov[i].iov_len);
+        written += size;
+        if (size < iov[i].iov_len)
+            break;
+    }
+    if (written == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (__atomic_load_n(&shm->out->reader_waiting, __ATOMIC_SEQ_CST))
+        shm_signal(shm->peer_data_fd);
+    return written;
+}
+
+/* Reads what is there without blocking, fails with EAGAIN if nothing is. */
+ssize_t netfs_shm_read(struct netfs_shm *shm, void *buf, size_t size)
+{
+    size_t read_bytes = ring_read(shm->in, buf, size);
+    if (read_bytes == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (__atomic_load_n(&shm->in->writer_waiting, __ATOMIC_SEQ_CST))
+        shm_signal(shm->peer_room_fd);
+    return read_bytes;
+}
+
+/* Like sendallv. Callers must not write to shm concurrently. */
+ssize_t netfs_shm_sendallv(struct netfs_shm *shm, struct iovec *iov,
+                           int iovcnt)
+{
+    iov_advance(&iov, &iovcnt, 0);
+    while (iovcnt > 0) {
+        ssize_t written = netfs_shm_write(shm, iov, iovcnt);
+        if (written > 0) {
+            iov_advance(&iov, &iovcnt, written);
+            continue;
+        }
+        /* Full, recheck after announcing the wait so no wakeup is lost. */
+        __atomic_store_n(&shm->out->writer_waiting, 1, __ATOMIC_SEQ_CST);
+        int res = 0;
+        if (__atomic_load_n(&shm->out->head, __ATOMIC_SEQ_CST) ==
+            shm->out->tail - NETFS_RING_SIZE)
+            res = shm_wait(shm, shm->room_fd);
+        __atomic_store_n(&shm->out->writer_waiting, 0, __ATOMIC_SEQ_CST);
+        if (res < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Like recvallv. Callers must not read from shm concurrently. */
+ssize_t netfs_shm_recvallv(struct netfs_shm *shm, struct iovec *iov,
+                           int iovcnt)
+{
+    iov_advance(&iov, &iovcnt, 0);
+    while (iovcnt > 0) {
+        ssize_t read_bytes =
+            netfs_shm_read(shm, iov[0].iov_base, iov[0].iov_len);
+        if (read_bytes > 0) {
+            iov_advance(&iov, &iovcnt, read_bytes);
+            continue;
+        }
+        __atomic_store_n(&shm->in->reader_waiting, 1, __ATOMIC_SEQ_CST);
+        int res = 0;
+        if (__atomic_load_n(&shm->in->tail, __ATOMIC_SEQ_CST) ==
+            shm->in->head)
+            res = shm_wait(shm, shm->data_fd);
+        __atomic_store_n(&shm->in->reader_waiting, 0, __ATOMIC_SEQ_CST);
+        if (res < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * For writers that can not block: asks the peer to signal room_fd once it
+ * reads from out. Signals it right away if there is room already.
+ */
+void netfs_shm_want_room(struct netfs_shm *shm, int want)
+{
+    __atomic_store_n(&shm->out->writer_waiting, want, __ATOMIC_SEQ_CST);
+    if (want && __atomic_load_n(&shm->out->head, __ATOMIC_SEQ_CST) !=
+                    shm->out->tail - NETFS_RING_SIZE)
+        shm_signal(shm->room_fd);
+}
+
+/* Resets both eventfds, before looking at the rings again. */
+void netfs_shm_clear(struct netfs_shm *shm)
+{
+    uint64_t value;
+    read(shm->data_fd, &value, sizeof(value));
+    read(shm->room_fd, &value, sizeof(value));
+}
+
+uint64_t netfs_monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void netfs_stats_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/* error is non-zero when the operation failed. */
+void netfs_stats_record(struct netfs_stats *stats, netfs_oper op,
+                        uint64_t us, int error)
+{
+    if (op >= NETFS_OPERATIONS)
+        return;
+    struct netfs_op_stats *op_stats = &stats->ops[op];
+    int bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+    if (bucket >= NETFS_STATS_BUCKETS)
+        bucket = NETFS_STATS_BUCKETS - 1;
+    netfs_stats_add(&op_stats->count, 1);
+    if (error)
+        netfs_stats_add(&op_stats->errors, 1);
+    netfs_stats_add(&op_stats->total_us, us);
+    netfs_stats_add(&op_stats->buckets[bucket], 1);
+    uint64_t max = __atomic_load_n(&op_stats->max_us, __ATOMIC_RELAXED);
+    while (us > max &&
+           !__atomic_compare_exchange_n(&op_stats->max_us, &max, us, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static const char *operation_name(int op)
+{
+    switch (op) {
+    case GETATTR:
+        return "GETATTR";
+    case READDIR:
+        return "READDIR";
+    case READDIRPLUS:
+        return "READDIRPLUS";
+    case READ:
+        return "READ";
+    case OPEN:
+        return "OPEN";
+    case RELEASE:
+        return "RELEASE";
+    case HELLO:
+        return "HELLO";
+    case CANCEL:
+        return "CANCEL";
+    default:
+        return NULL;
+    }
+}
+
+/* Appends to buf, dropping what does not fit. */
+static size_t stats_append(char *buf, size_t size, size_t length,
+                           const char *format, ...)
+{
+    if (length >= size)
+        return length;
+    va_list args;
+    va_start(args, format);
+    int res = vsnprintf(buf + length, size - length, format, args);
+    va_end(args);
+    if (res < 0)
+        return length;
+    return length + res < size ? length + res : size - 1;
+}
+
+/* Latency below which percentile percent of the samples fall, at most max. */
+static uint64_t stats_percentile(const uint64_t *buckets, uint64_t count,
+                                 uint64_t max, unsigned int percentile)
+{
+    uint64_t wanted = (count * percentile + 99) / 100;
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < NETFS_STATS_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= wanted)
+            break;
+    }
+    uint64_t limit = (uint64_t)2 << i;
+    return limit < max ? limit : max;
+}
+
+/*
+ * Writes the statistics as text, a line per operation seen followed by its
+ * histogram. Returns the length, at most size - 1.
+ */
+size_t netfs_stats_format(struct netfs_stats *stats, char *buf, size_t size)
+{
+    size_t length = stats_append(buf, size, 0,
+                                 "%-12s %10s %8s %10s %10s %10s %10s\n",
+                                 "operation", "count", "errors", "mean_us",
+                                 "p50_us", "p99_us", "max_us");
+    int op;
+    for (op = 0; op < NETFS_OPERATIONS; op++) {
+        struct netfs_op_stats *op_stats = &stats->ops[op];
+        uint64_t buckets[NETFS_STATS_BUCKETS];
+        uint64_t count = 0;
+        int i;
+        for (i = 0; i < NETFS_STATS_BUCKETS; i++) {
+            buckets[i] =
+                __atomic_load_n(&op_stats->buckets[i], __ATOMIC_RELAXED);
+            count += buckets[i];
+        }
+        if (count == 0)
+            continue;
+
+        const char *name = operation_name(op);
+        char number[16];
+        if (name == NULL) {
+            snprintf(number, sizeof(number), "%d", op);
+            name = number;
+        }
+        uint64_t total =
+            __atomic_load_n(&op_stats->total_us, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&op_stats->max_us, __ATOMIC_RELAXED);
+        length = stats_append(
+            buf, size, length,
+            "%-12s %10" PRIu64 " %8" PRIu64 " %10" PRIu64 " %10" PRIu64
+            " %10" PRIu64 " %10" PRIu64 "\n",
+            name, count,
+            __atomic_load_n(&op_stats->errors, __ATOMIC_RELAXED),
+            total / count, stats_percentile(buckets, count, max, 50),
+            stats_percentile(buckets, count, max, 99), max);
+        length = stats_append(buf, size, length, "  histogram");
+        for (i = 0; i < NETFS_STATS_BUCKETS; i++) {
+            if (buckets[i] != 0)
+                length = stats_append(buf, size, length,
+                                      " <%" PRIu64 "us:%" PRIu64,
+                                      (uint64_t)2 << i, buckets[i]);
+        }
+        length = stats_append(buf, size, length, "\n");
+    }
+
+    uint64_t waits = __atomic_load_n(&stats->waits, __ATOMIC_RELAXED);
+    uint64_t wait_us = __atomic_load_n(&stats->wait_us, __ATOMIC_RELAXED);
+    length = stats_append(
+        buf, size, length,
+        "bytes_in %" PRIu64 "\nbytes_out %" PRIu64 "\nwaits %" PRIu64
+        "\nwait_us %" PRIu64 "\n",
+        __atomic_load_n(&stats->bytes_in, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats->bytes_out, __ATOMIC_RELAXED), waits, wait_us);
+    return length;
+}
@@ -4,16 +4,18 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 typedef uint8_t netfs_oper;
 
 struct netfs_header {
     uint32_t payload_length;
     netfs_oper operation;
+    uint32_t tag; /* Chosen by the client, echoed in the response */
 } __attribute__((packed));
 
 struct netfs_attrs {
-    uint32_t mode;
+    uint32_t mode; /* 0 for a READDIRPLUS entry whose attributes are withheld */
     uint32_t nlink;
     uint32_t uid;
     uint32_t gid;
@@ -23,8 +25,30 @@ struct netfs_attrs {
     uint32_t ctime;
 } __attribute__((packed));
 
+/* HELLO and HELLO_R payload, what the sender speaks and accepts */
+struct netfs_hello {
+    uint32_t version;
+    uint32_t capabilities; /* NETFS_CAP_ bits */
+    uint32_t max_request;  /* Largest request payload the sender accepts */
+    uint32_t max_response; /* Largest response payload the sender accepts */
+    uint32_t io_size;      /* Preferred READ size */
+} __attribute__((packed));
+
+/*
+ * May follow a client's netfs_hello. Handles opened on one connection are
+ * usable on every connection presenting the same non-zero session.
+ */
+struct netfs_hello_session {
+    uint64_t session; /* Random, chosen once per client */
+} __attribute__((packed));
+
+/* READDIR and READDIRPLUS payload, followed by the directory path */
+struct netfs_readdir {
+    uint64_t cookie; /* 0, or the cookie of the last entry consumed */
+} __attribute__((packed));
+
 struct netfs_read_write {
-    uint32_t path_len;
+    uint64_t handle; /* From OPEN_R */
     uint64_t file_offset;
     uint64_t count;
 } __attribute__((packed));
@@ -32,23 +56,120 @@ struct netfs_read_write {
 /* Operation Types */
 #define GETATTR 1
 #define GETATTR_R 2 // Response
+/* READDIR_R is an eof byte and entries of cookie, length, name */
 #define READDIR 3
 #define READDIR_R 4
 #define READ 7
 #define READ_R 8
 #define ERROR 9
+#define READDIRPLUS 10 // Like READDIR, each name is preceded by netfs_attrs
+#define READDIRPLUS_R 11
+#define OPEN 12 // Payload is the path, OPEN_R carries a 64 bit handle
+#define OPEN_R 13
+#define RELEASE 14 // Payload is the handle
+#define RELEASE_R 15
+#define HELLO 16 // Sent first on every connection, answered by HELLO_R
+#define HELLO_R 17
+#define CANCEL 18 // Tag of a request to drop if still queued, no response
+#define INVALIDATE 19 // Pushed by the server, the path changed, "" for all
+
+/* Protocol version and capabilities, negotiated by HELLO */
+#define NETFS_VERSION 1
+#define NETFS_CAP_READDIRPLUS (1 << 0)
+#define NETFS_CAP_CANCEL (1 << 1)
+#define NETFS_CAP_INVALIDATE (1 << 2) /* Leases, revoked by INVALIDATE */
 
 /* Useful macros */
 #define OFFSET(pointer, off) ((char *)pointer + off)
 #define NETFS_HEADER_SIZE sizeof(struct netfs_header)
 #define NETFS_PACKET_SIZE(payload_length) (NETFS_HEADER_SIZE + payload_length)
 #define NETFS_PAYLOAD(packet_ptr) OFFSET(packet_ptr, NETFS_HEADER_SIZE)
-#define PREP_NETFS_HEADER(packet, payload_size, op)                            \
+#define PREP_NETFS_HEADER(packet, payload_size, op, req_tag)                   \
     ((struct netfs_header *)packet)->payload_length = htonl(payload_size);     \
-    ((struct netfs_header *)packet)->operation = op
+    ((struct netfs_header *)packet)->operation = op;                           \
+    ((struct netfs_header *)packet)->tag = htonl(req_tag)
+
+/* Largest pooled buffer, bounds READ counts and buffered responses */
+#define NETFS_MAX_BUFFER (1024 * 1024)
+
+/* Transports, chosen by the address both sides are given */
+#define NETFS_TRANSPORT_TCP 0
+#define NETFS_TRANSPORT_UNIX 1 /* "unix:PATH" */
+#define NETFS_TRANSPORT_SHM 2  /* "shm:PATH", rings set up over PATH */
+
+#define NETFS_RING_SIZE (4 * 1024 * 1024) /* Power of two */
+
+/* A byte stream in one direction, written and read by one thread each. */
+struct netfs_ring {
+    uint64_t tail __attribute__((aligned(64))); /* Written up to here */
+    uint32_t reader_waiting;
+    uint64_t head __attribute__((aligned(64))); /* Read up to here */
+    uint32_t writer_waiting;
+    uint8_t data[NETFS_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/*
+ * One end of a shared memory connection. The eventfds wake a side that
+ * found its ring empty or full, the socket only reports the peer leaving.
+ */
+struct netfs_shm {
+    struct netfs_ring *in;
+    struct netfs_ring *out;
+    int sock_fd;
+    int data_fd;      /* Signalled when in has data */
+    int room_fd;      /* Signalled when out has room */
+    int peer_data_fd; /* The peer's data_fd */
+    int peer_room_fd; /* The peer's room_fd */
+};
+
+/*
+ * Cumulative statistics, updated with atomics so any thread records them
+ * without a lock. Bucket n counts latencies below 2^(n + 1) microseconds.
+ */
+#define NETFS_OPERATIONS 32 /* Bounds the operation codes */
+#define NETFS_STATS_BUCKETS 32
+#define NETFS_STATS_TEXT_MAX (64 * 1024)
+
+struct netfs_op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[NETFS_STATS_BUCKETS];
+};
+
+struct netfs_stats {
+    struct netfs_op_stats ops[NETFS_OPERATIONS];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t waits; /* For a connection slot, or in a queue on the server */
+    uint64_t wait_us;
+};
 
 /* Helper Functions */
 ssize_t sendall(int socket_fd, void *packet, size_t size);
 ssize_t recvall(int socket_fd, void *packet, size_t size);
+ssize_t sendallv(int socket_fd, struct iovec *iov, int iovcnt);
+ssize_t recvallv(int socket_fd, struct iovec *iov, int iovcnt);
+uint32_t netfs_hash(const char *str, size_t len);
+int netfs_parse_address(const char *address, const char **path);
+struct netfs_shm *netfs_shm_create(int sock_fd);
+struct netfs_shm *netfs_shm_attach(int sock_fd);
+void netfs_shm_free(struct netfs_shm *shm);
+ssize_t netfs_shm_sendallv(struct netfs_shm *shm, struct iovec *iov,
+                           int iovcnt);
+ssize_t netfs_shm_recvallv(struct netfs_shm *shm, struct iovec *iov,
+                           int iovcnt);
+ssize_t netfs_shm_write(struct netfs_shm *shm, struct iovec *iov, int iovcnt);
+ssize_t netfs_shm_read(struct netfs_shm *shm, void *buf, size_t size);
+void netfs_shm_want_room(struct netfs_shm *shm, int want);
+void netfs_shm_clear(struct netfs_shm *shm);
+void *netfs_buf_alloc(size_t size);
+void netfs_buf_free(void *buf);
+uint64_t netfs_monotonic_us(void);
+void netfs_stats_record(struct netfs_stats *stats, netfs_oper op,
+                        uint64_t us, int error);
+void netfs_stats_add(uint64_t *counter, uint64_t value);
+size_t netfs_stats_format(struct netfs_stats *stats, char *buf, size_t size);
 
 #endif
\ No newline at end of file